@@ -0,0 +1,47 @@
+#include "analyze.hpp"
+#include <string.h>
+
+void analyze_trace(trace_source_t* source, uint64_t f, const proc_options_t &options, analysis_t* result) {
+    memset(result, 0, sizeof(*result));
+
+    // per register: the cycle its value is ready, without and with the
+    // fetch limit, and 1 + the index of the instruction that wrote it (0
+    // for none)
+    std::vector<uint64_t> ready(PROC_NUM_REGS, 0), ready_fetch(PROC_NUM_REGS, 0), writer(PROC_NUM_REGS, 0);
+
+    proc_inst_t inst;
+    uint64_t i = 0;
+    for (; source->read_instruction(&inst); i++) {
+        result->op_class[inst.op_code]++;
+        if (inst.flags & INST_BRANCH)
+            result->branches++;
+        if (inst.flags & INST_LOAD)
+            result->loads++;
+        if (inst.flags & INST_STORE)
+            result->stores++;
+
+        uint64_t start = 0, start_fetch = i / f;
+        for (int k = 0; k < 2; k++) {
+            int32_t reg = inst.src_reg[k];
+            if (reg == -1)
+                continue;
+            start = std::max(start, ready[reg]);
+            start_fetch = std::max(start_fetch, ready_fetch[reg]);
+            if (writer[reg] != 0)
+                result->dep_distance.add(i + 1 - writer[reg]);
+            else
+                result->no_producer++;
+        }
+
+        uint32_t latency = options.fu_latency[inst.op_code];
+        uint64_t done = start + latency, done_fetch = start_fetch + latency;
+        if (inst.dest_reg != -1) {
+            ready[inst.dest_reg] = done;
+            ready_fetch[inst.dest_reg] = done_fetch;
+            writer[inst.dest_reg] = i + 1;
+        }
+        result->critical_path = std::max(result->critical_path, done);
+        result->fetch_bound_path = std::max(result->fetch_bound_path, done_fetch);
+    }
+    result->instructions = i;
+}
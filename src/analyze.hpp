@@ -0,0 +1,33 @@
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+#include "stats.hpp"
+
+/*
+  the dataflow limit of a trace, found in one pass with a few words per
+  register. every instruction starts once its source registers are
+  written and takes its FU class's latency, with no limit on units or
+  result buses. the same, with instructions also fetched in order F per
+  cycle, bounds the IPC of any machine of fetch width F.
+*/
+struct analysis_t {
+    uint64_t instructions;
+    uint64_t op_class[NUM_FU_CLASSES];
+    uint64_t branches;
+    uint64_t loads;
+    uint64_t stores;
+
+    // cycles until the last result is written
+    uint64_t critical_path;
+    uint64_t fetch_bound_path;
+
+    // distance in instructions from each source operand's producer; reads
+    // of registers nothing in the trace has written yet are counted apart
+    log2_histogram_t dep_distance;
+    uint64_t no_producer;
+};
+
+// f must be at least 1
+void analyze_trace(trace_source_t* source, uint64_t f, const proc_options_t &options, analysis_t* result);
+
+#endif /* ANALYZE_H */
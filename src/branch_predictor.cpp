@@ -0,0 +1,150 @@
+#include "branch_predictor.hpp"
+#include <string.h>
+
+static const char* const bp_names[NUM_BP_KINDS] = { "none", "bimodal", "gshare", "tage" };
+
+gshare_predictor_t::gshare_predictor_t(uint32_t table_bits, uint32_t history_bits) : history(0) {
+    counters.reset(table_bits);
+    history_mask = history_bits >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << history_bits) - 1;
+}
+
+void gshare_predictor_t::update(uint64_t pc, bool taken) {
+    counters.train(index(pc), taken);
+    history = history << 1 | taken;
+}
+
+void gshare_predictor_t::checkpoint(checkpoint_io_t &io) {
+    counters.checkpoint(io);
+    io.pod(history);
+    io.pod(history_mask);
+}
+
+// xor-folds the low len bits of h down to bits bits
+static uint32_t fold(uint64_t h, uint32_t len, uint32_t bits) {
+    if (len < 64)
+        h &= ((uint64_t)1 << len) - 1;
+    uint32_t folded = 0;
+    for (; h; h >>= bits)
+        folded ^= h & ((1u << bits) - 1);
+    return folded;
+}
+
+tage_predictor_t::tage_predictor_t(uint32_t table_bits, uint32_t history_bits) : history(0) {
+    base.reset(table_bits);
+    tagged_bits = table_bits > 6 ? table_bits - 2 : 4;
+    if (history_bits > 64)
+        history_bits = 64;
+    // a tag no lookup produces, so empty entries never match
+    entry_t empty;
+    empty.tag = 0xffff;
+    empty.ctr = 0;
+    empty.useful = 0;
+    for (int i = 0; i < TAGE_TABLES; i++) {
+        tables[i].assign(1u << tagged_bits, empty);
+        // history_bits / 8, / 4, / 2, / 1
+        length[i] = history_bits >> (TAGE_TABLES - 1 - i);
+        if (length[i] == 0)
+            length[i] = i + 1;
+    }
+}
+
+void tage_predictor_t::lookup(uint64_t pc) {
+    provider = alternate = -1;
+    for (int i = 0; i < TAGE_TABLES; i++) {
+        index[i] = (pc ^ (pc >> tagged_bits) ^ fold(history, length[i], tagged_bits)) & ((1u << tagged_bits) - 1);
+        tag[i] = (pc ^ fold(history, length[i], TAGE_TAG_BITS) ^ (fold(history, length[i], TAGE_TAG_BITS - 1) << 1))
+            & ((1u << TAGE_TAG_BITS) - 1);
+    }
+    for (int i = TAGE_TABLES - 1; i >= 0; i--) {
+        if (tables[i][index[i]].tag == tag[i]) {
+            if (provider < 0) {
+                provider = i;
+            } else {
+                alternate = i;
+                break;
+            }
+        }
+    }
+    bool base_pred = base.taken(pc & base.size_mask());
+    provider_pred = provider >= 0 ? tables[provider][index[provider]].ctr >= 0 : base_pred;
+    alternate_pred = alternate >= 0 ? tables[alternate][index[alternate]].ctr >= 0 : base_pred;
+}
+
+bool tage_predictor_t::predict(uint64_t pc) {
+    lookup(pc);
+    return provider_pred;
+}
+
+void tage_predictor_t::update(uint64_t pc, bool taken) {
+    if (provider >= 0) {
+        entry_t &e = tables[provider][index[provider]];
+        if (taken && e.ctr < 3)
+            e.ctr++;
+        else if (!taken && e.ctr > -4)
+            e.ctr--;
+        if (provider_pred != alternate_pred) {
+            if (provider_pred == taken && e.useful < 3)
+                e.useful++;
+            else if (provider_pred != taken && e.useful > 0)
+                e.useful--;
+        }
+    } else {
+        base.train(pc & base.size_mask(), taken);
+    }
+
+    // on a mispredict, claim an entry in a table with a longer history
+    if (provider_pred != taken) {
+        bool allocated = false;
+        for (int i = provider + 1; i < TAGE_TABLES && !allocated; i++) {
+            entry_t &e = tables[i][index[i]];
+            if (e.useful == 0) {
+                e.tag = tag[i];
+                e.ctr = taken ? 0 : -1;
+                allocated = true;
+            }
+        }
+        if (!allocated) {
+            for (int i = provider + 1; i < TAGE_TABLES; i++) {
+                if (tables[i][index[i]].useful > 0)
+                    tables[i][index[i]].useful--;
+            }
+        }
+    }
+    history = history << 1 | taken;
+}
+
+void tage_predictor_t::checkpoint(checkpoint_io_t &io) {
+    base.checkpoint(io);
+    for (int i = 0; i < TAGE_TABLES; i++)
+        io.vec(tables[i]);
+    io.pod(tagged_bits);
+    io.pod(length);
+    io.pod(history);
+}
+
+branch_predictor_t* make_branch_predictor(bp_kind_t kind, uint32_t table_bits, uint32_t history_bits) {
+    switch (kind) {
+    case BP_BIMODAL:
+        return new bimodal_predictor_t(table_bits);
+    case BP_GSHARE:
+        return new gshare_predictor_t(table_bits, history_bits);
+    case BP_TAGE:
+        return new tage_predictor_t(table_bits, history_bits);
+    default:
+        return NULL;
+    }
+}
+
+bool parse_bp_kind(const char* name, bp_kind_t* kind) {
+    for (int i = 0; i < NUM_BP_KINDS; i++) {
+        if (strcmp(name, bp_names[i]) == 0) {
+            *kind = (bp_kind_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* bp_kind_name(bp_kind_t kind) {
+    return kind < NUM_BP_KINDS ? bp_names[kind] : "?";
+}
@@ -0,0 +1,137 @@
+#ifndef BRANCH_PREDICTOR_H
+#define BRANCH_PREDICTOR_H
+
+#include <cstdint>
+#include <vector>
+#include "checkpoint.hpp"
+
+enum bp_kind_t {
+    BP_NONE,        // every branch predicted correctly
+    BP_BIMODAL,
+    BP_GSHARE,
+    BP_TAGE,
+    NUM_BP_KINDS
+};
+
+// direction predictor consulted by fetch. every predict() is followed by
+// the update() for the same branch before the next predict().
+class branch_predictor_t {
+public:
+    virtual ~branch_predictor_t() { }
+
+    virtual bool predict(uint64_t pc) = 0;
+    virtual void update(uint64_t pc, bool taken) = 0;
+
+    // saves or restores the tables and history
+    virtual void checkpoint(checkpoint_io_t &io) = 0;
+};
+
+// 2-bit saturating counters packed four to a byte
+class counter_table_t {
+public:
+    void reset(uint32_t bits) {
+        mask = (1u << bits) - 1;
+        // weakly not taken
+        table.assign(((mask + 1) + 3) / 4, 0x55);
+    }
+    uint32_t size_mask() const { return mask; }
+    void checkpoint(checkpoint_io_t &io) { io.pod(mask); io.vec(table); }
+
+    bool taken(uint32_t i) const { return get(i) >= 2; }
+    void train(uint32_t i, bool taken) {
+        uint32_t c = get(i);
+        if (taken && c < 3)
+            set(i, c + 1);
+        else if (!taken && c > 0)
+            set(i, c - 1);
+    }
+
+private:
+    uint32_t get(uint32_t i) const { return (table[i >> 2] >> ((i & 3) * 2)) & 3; }
+    void set(uint32_t i, uint32_t c) {
+        uint8_t &b = table[i >> 2];
+        b = (b & ~(3 << ((i & 3) * 2))) | (c << ((i & 3) * 2));
+    }
+
+    uint32_t mask;
+    std::vector<uint8_t> table;
+};
+
+// a counter per pc
+class bimodal_predictor_t : public branch_predictor_t {
+public:
+    bimodal_predictor_t(uint32_t table_bits) { counters.reset(table_bits); }
+
+    bool predict(uint64_t pc) { return counters.taken(pc & counters.size_mask()); }
+    void update(uint64_t pc, bool taken) { counters.train(pc & counters.size_mask(), taken); }
+    void checkpoint(checkpoint_io_t &io) { counters.checkpoint(io); }
+
+private:
+    counter_table_t counters;
+};
+
+// a counter per pc xor global history
+class gshare_predictor_t : public branch_predictor_t {
+public:
+    gshare_predictor_t(uint32_t table_bits, uint32_t history_bits);
+
+    bool predict(uint64_t pc) { return counters.taken(index(pc)); }
+    void update(uint64_t pc, bool taken);
+    void checkpoint(checkpoint_io_t &io);
+
+private:
+    uint32_t index(uint64_t pc) const { return (pc ^ (history & history_mask)) & counters.size_mask(); }
+
+    counter_table_t counters;
+    uint64_t history;
+    uint64_t history_mask;
+};
+
+/*
+  a small TAGE: a bimodal base table and TAGE_TABLES tagged tables indexed
+  with geometrically longer slices of the global history, the longest of
+  them history_bits (at most 64) long. the longest matching table provides
+  the prediction.
+*/
+#define TAGE_TABLES 4
+#define TAGE_TAG_BITS 10
+
+class tage_predictor_t : public branch_predictor_t {
+public:
+    tage_predictor_t(uint32_t table_bits, uint32_t history_bits);
+
+    bool predict(uint64_t pc);
+    void update(uint64_t pc, bool taken);
+    void checkpoint(checkpoint_io_t &io);
+
+private:
+    // 4 bytes an entry
+    struct entry_t {
+        uint16_t tag;
+        int8_t ctr;         // 3-bit signed, taken when >= 0
+        uint8_t useful;
+    };
+
+    void lookup(uint64_t pc);
+
+    counter_table_t base;
+    std::vector<entry_t> tables[TAGE_TABLES];
+    uint32_t tagged_bits;
+    uint32_t length[TAGE_TABLES];
+    uint64_t history;
+
+    // the last lookup
+    uint32_t index[TAGE_TABLES];
+    uint16_t tag[TAGE_TABLES];
+    int provider, alternate;
+    bool provider_pred, alternate_pred;
+};
+
+// NULL for BP_NONE
+branch_predictor_t* make_branch_predictor(bp_kind_t kind, uint32_t table_bits, uint32_t history_bits);
+
+// "none", "bimodal", "gshare" or "tage"; returns false if name is none of them
+bool parse_bp_kind(const char* name, bp_kind_t* kind);
+const char* bp_kind_name(bp_kind_t kind);
+
+#endif /* BRANCH_PREDICTOR_H */
@@ -0,0 +1,69 @@
+#include "cache.hpp"
+
+// no line address has every bit set
+#define NO_TAG (~(uint64_t)0)
+
+static uint64_t cache_sets(const cache_level_config_t &config) {
+    return config.ways ? (config.size >> CACHE_LINE_BITS) / config.ways : 0;
+}
+
+void cache_t::reset(const cache_level_config_t &config) {
+    ways = config.ways;
+    set_mask = cache_sets(config) - 1;
+    tags.assign(cache_sets(config) * ways, NO_TAG);
+}
+
+bool cache_t::access(uint64_t addr) {
+    uint64_t line = addr >> CACHE_LINE_BITS;
+    uint64_t* set = &tags[(line & set_mask) * ways];
+
+    uint32_t way = 0;
+    while (way < ways && set[way] != line)
+        way++;
+    bool hit = way < ways;
+
+    // move the line to the front, dropping the LRU one on a miss
+    if (!hit)
+        way = ways - 1;
+    for (; way > 0; way--)
+        set[way] = set[way - 1];
+    set[0] = line;
+    return hit;
+}
+
+void cache_hierarchy_t::reset(const cache_config_t &c) {
+    config = c;
+    levels = 0;
+    while (levels < CACHE_LEVELS && config.level[levels].size > 0) {
+        caches[levels].reset(config.level[levels]);
+        levels++;
+    }
+}
+
+uint32_t cache_hierarchy_t::access(uint64_t addr, int* level) {
+    uint32_t latency = 0;
+    for (int i = 0; i < levels; i++) {
+        latency += config.level[i].latency;
+        if (caches[i].access(addr)) {
+            // the levels above took the line when they missed
+            *level = i;
+            return latency;
+        }
+    }
+    *level = CACHE_LEVELS;
+    return latency + config.mem_latency;
+}
+
+bool valid_cache_config(const cache_config_t &config) {
+    for (int i = 0; i < CACHE_LEVELS; i++) {
+        if (config.level[i].size == 0)
+            continue;
+        uint64_t sets = cache_sets(config.level[i]);
+        if (sets == 0 || (sets & (sets - 1)) != 0)
+            return false;
+        // an L2 needs an L1
+        if (i > 0 && config.level[0].size == 0)
+            return false;
+    }
+    return true;
+}
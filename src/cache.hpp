@@ -0,0 +1,81 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <cstdint>
+#include <vector>
+#include "checkpoint.hpp"
+
+#define CACHE_LINE_BITS 6
+#define CACHE_LEVELS 2
+
+// one level of the hierarchy; size 0 leaves it out
+struct cache_level_config_t {
+    uint64_t size;      // bytes
+    uint32_t ways;
+    uint32_t latency;   // cycles added by a hit
+};
+
+// the caches in front of memory. the defaults model no caches at all, so
+// loads and stores take no longer than any other instruction.
+struct cache_config_t {
+    cache_config_t() : mem_latency(0) {
+        for (int i = 0; i < CACHE_LEVELS; i++) {
+            level[i].size = 0;
+            level[i].ways = 0;
+            level[i].latency = 0;
+        }
+    }
+    bool enabled() const { return level[0].size > 0; }
+
+    cache_level_config_t level[CACHE_LEVELS];
+    // cycles added by a miss in every level
+    uint32_t mem_latency;
+};
+
+/*
+  a set-associative, write-allocate cache with LRU replacement. each set's
+  tags sit next to each other, most recently used first, so a probe is a
+  short linear scan of one run of the tag array.
+*/
+class cache_t {
+public:
+    cache_t() : ways(0), set_mask(0) { }
+
+    // sets (size / line / ways) must come out a power of two
+    void reset(const cache_level_config_t &config);
+
+    // true on a hit. either way the line is most recently used afterwards
+    bool access(uint64_t addr);
+
+    void checkpoint(checkpoint_io_t &io) { io.pod(ways); io.pod(set_mask); io.vec(tags); }
+
+private:
+    uint32_t ways;
+    uint64_t set_mask;
+    std::vector<uint64_t> tags;
+};
+
+// L1 and L2 in front of memory. access() returns the latency it adds and
+// the level that had the line, CACHE_LEVELS for memory.
+class cache_hierarchy_t {
+public:
+    void reset(const cache_config_t &config);
+    uint32_t access(uint64_t addr, int* level);
+
+    void checkpoint(checkpoint_io_t &io) {
+        io.pod(config);
+        io.pod(levels);
+        for (int i = 0; i < levels; i++)
+            caches[i].checkpoint(io);
+    }
+
+private:
+    cache_config_t config;
+    int levels;
+    cache_t caches[CACHE_LEVELS];
+};
+
+// true if every configured level has a power-of-two number of sets
+bool valid_cache_config(const cache_config_t &config);
+
+#endif /* CACHE_H */
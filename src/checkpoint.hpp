@@ -0,0 +1,92 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <sys/stat.h>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+
+#define CHECKPOINT_MAGIC "PSIMCKP1"
+#define CHECKPOINT_VERSION 2
+
+/*
+  reads or writes a machine snapshot one field at a time, so that the same
+  function describes the state in both directions. fields are raw host
+  bytes: a snapshot is only good for the build that wrote it.
+*/
+class checkpoint_io_t {
+public:
+    checkpoint_io_t(FILE* file, bool writing) : file(file), write(writing), good(true) { }
+
+    bool writing() const { return write; }
+    // false once a read came up short or a write failed
+    bool ok() const { return good; }
+
+    void bytes(void* data, size_t n) {
+        if (!good || n == 0)
+            return;
+        good = (write ? fwrite(data, 1, n, file) : fread(data, 1, n, file)) == n;
+    }
+
+    template <typename T> void pod(T &v) { bytes(&v, sizeof(T)); }
+
+    template <typename T> void vec(std::vector<T> &v) {
+        uint64_t n = v.size();
+        pod(n);
+        // a corrupt length must not allocate more than the file still holds
+        if (!write && good && n > remaining() / sizeof(T))
+            good = false;
+        if (!write)
+            v.resize(good ? n : 0);
+        bytes(v.data(), v.size() * sizeof(T));
+    }
+
+    template <typename T> void deq(std::deque<T> &d) {
+        std::vector<T> v(d.begin(), d.end());
+        vec(v);
+        if (!write)
+            d.assign(v.begin(), v.end());
+    }
+
+    // the heap is written in pop order and pushed back on reading
+    template <typename T, typename C, typename L> void heap(std::priority_queue<T, C, L> &q) {
+        std::vector<T> v;
+        if (write) {
+            std::priority_queue<T, C, L> copy(q);
+            for (; !copy.empty(); copy.pop())
+                v.push_back(copy.top());
+        }
+        vec(v);
+        if (!write) {
+            q = std::priority_queue<T, C, L>();
+            for (size_t i = 0; i < v.size(); i++)
+                q.push(v[i]);
+        }
+    }
+
+    template <typename K, typename V> void map(std::unordered_map<K, V> &m) {
+        std::vector<std::pair<K, V> > v(m.begin(), m.end());
+        vec(v);
+        if (!write)
+            m = std::unordered_map<K, V>(v.begin(), v.end());
+    }
+
+private:
+    // bytes left to read, or as good as unlimited if that cannot be told
+    uint64_t remaining() const {
+        struct stat st;
+        off_t pos = ftello(file);
+        if (pos < 0 || fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode))
+            return UINT64_MAX;
+        return st.st_size > pos ? st.st_size - pos : 0;
+    }
+
+    FILE* file;
+    bool write;
+    bool good;
+};
+
+#endif /* CHECKPOINT_H */
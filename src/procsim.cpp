@@ -1,25 +1,70 @@
 #include "procsim.hpp"
+#include "timing_sink.hpp"
+#include "stats.hpp"
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-proc_settings_t cpu;
+static const int debug = 0;
 
-std::vector<proc_inst_ptr_t> all_instrs;
+// build with -DPROCSIM_STAGE_TIMERS to time every stage call in run()
+#ifdef PROCSIM_STAGE_TIMERS
+#define TIMED_STAGE(stage, call) do { \
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now(); \
+        call; \
+        stage_time[stage] += std::chrono::steady_clock::now() - start; \
+    } while (0)
+#else
+#define TIMED_STAGE(stage, call) call
+#endif
 
-std::deque<proc_inst_ptr_t> dispatching_queue;
-std::vector<proc_inst_ptr_t> scheduling_queue;
-uint32_t scheduling_queue_limit;
+// the processor behind the legacy C-style entry points
+static processor_t default_proc(NULL);
 
-std::unordered_map<uint32_t, register_info_t> register_file;
+void set_trace_source(trace_source_t* source) {
+    default_proc = processor_t(source);
+}
+
+void setup_proc(proc_stats_t *p_stats, uint64_t r, uint64_t k0, uint64_t k1, uint64_t k2, uint64_t f, uint64_t begin_dump, uint64_t end_dump) {
+    default_proc.setup(p_stats, r, k0, k1, k2, f, begin_dump, end_dump);
+}
+
+void complete_proc(proc_stats_t *p_stats) {
+    default_proc.complete(p_stats);
+}
+
+void run_proc(proc_stats_t* p_stats) {
+    default_proc.run(p_stats);
+}
+
+void state_update(proc_stats_t* p_stats, const cycle_half_t &half) {
+    default_proc.state_update(p_stats, half);
+}
+
+void execute(proc_stats_t* p_stats, const cycle_half_t &half) {
+    default_proc.execute(p_stats, half);
+}
+
+void schedule(proc_stats_t* p_stats, const cycle_half_t &half) {
+    default_proc.schedule(p_stats, half);
+}
 
-std::vector<proc_cdb_t> cdb;
-std::unordered_map<uint32_t, uint32_t> fu_cnt;
+void dispatch(proc_stats_t* p_stats, const cycle_half_t &half) {
+    default_proc.dispatch(p_stats, half);
+}
 
+void instr_fetch_and_decode(proc_stats_t* p_stats, const cycle_half_t &half) {
+    default_proc.instr_fetch_and_decode(p_stats, half);
+}
 
-int debug = 0;
+processor_t::processor_t(const std::vector<trace_source_t*> &sources)
+    : threads(sources.begin(), sources.end()), timing_sink(NULL), stop_at(0), detail(NULL), kernel(NULL) { }
 
-int get_sqfree_slots();
-void print_register_file();
-void print_cdb();
 /**
  * Subroutine for initializing the processor. You many add and initialize any global or heap
  * variables as needed.
@@ -31,21 +76,81 @@ void print_cdb();
  * @k2 Number of k2 FUs
  * @f Number of instructions to fetch
  */
-void setup_proc(proc_stats_t *p_stats, uint64_t r, uint64_t k0, uint64_t k1, uint64_t k2, uint64_t f, uint64_t begin_dump, uint64_t end_dump) {
-    p_stats->retired_instruction = 0;
-    p_stats->cycle_count = 1;
-
+void processor_t::setup(proc_stats_t *p_stats, uint64_t r, uint64_t k0, uint64_t k1, uint64_t k2, uint64_t f, uint64_t begin_dump, uint64_t end_dump) {
     cpu = proc_settings_t(f, begin_dump, end_dump);
-
-    for(int i = 0; i < 64; i++){
-        register_file[i] = {true};    
+#ifdef PROCSIM_STAGE_TIMERS
+    for(int i = 0; i < NUM_STAGES; i++){
+        stage_time[i] = std::chrono::steady_clock::duration::zero();
     }
-
+#endif
     scheduling_queue_limit = 2 * (k0 + k1 + k2);
-    cdb.resize(r, {true});
+    cdb.reset(r);
     fu_cnt[0] = k0;
     fu_cnt[1] = k1;
     fu_cnt[2] = k2;
+
+    if(detail){
+        for(int i = 0; i < NUM_FU_CLASSES; i++){
+            detail->fu_count[i] = fu_cnt[i];
+        }
+        detail->buses = r;
+    }
+    select_kernel();
+
+    reset_pipeline(p_stats);
+    predictor.reset(make_branch_predictor(options.bp_kind, options.bp_table_bits, options.bp_history_bits));
+    caches.reset(options.cache);
+}
+
+// a processor may be set up again for another run
+void processor_t::reset_pipeline(proc_stats_t* p_stats) {
+    p_stats->retired_instruction = 0;
+    p_stats->cycle_count = 1;
+    for(int i = 0; i < PROC_MAX_THREADS; i++){
+        p_stats->thread_retired[i] = 0;
+        p_stats->thread_cycles[i] = 0;
+    }
+
+    cpu = proc_settings_t(cpu.f, cpu.begin_dump, cpu.end_dump);
+
+    instrs.clear();
+    dump_pending.clear();
+    next_dump_id = cpu.begin_dump;
+    dispatched.clear();
+    woken.clear();
+    for(int i = 0; i < NUM_FU_CLASSES; i++){
+        ready[i] = std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<uint64_t> >();
+    }
+    executing.clear();
+    in_flight = std::priority_queue<std::pair<uint64_t, uint64_t>, std::vector<std::pair<uint64_t, uint64_t> >,
+                                    std::greater<std::pair<uint64_t, uint64_t> > >();
+    completed.clear();
+    retiring.clear();
+    mem_resolved.clear();
+
+    for(unsigned t = 0; t < threads.size(); t++){
+        hw_thread_t &thread = threads[t];
+        thread.dispatching_queue.clear();
+        thread.last_store.clear();
+        for(int i = 0; i < PROC_NUM_REGS; i++){
+            thread.register_file.tag[i] = 0;
+            thread.register_file.ready[i] = true;
+            thread.register_file.producer[i] = 0;
+        }
+        thread.rob.reset(options.rob_size);
+        thread.fetched = 0;
+        thread.read_finished = false;
+        thread.mispredict_pending = false;
+        thread.fetch_resume_cycle = 0;
+        thread.icount = 0;
+    }
+    fetch_next = 0;
+
+    scheduling_queue.reset(scheduling_queue_limit);
+    cdb.reset(cdb.buses);
+    for(int i = 0; i < NUM_FU_CLASSES; i++){
+        in_flight_cnt[i] = 0;
+    }
 }
 
 /**
@@ -55,7 +160,13 @@ void setup_proc(proc_stats_t *p_stats, uint64_t r, uint64_t k0, uint64_t k1, uin
  *
  * @p_stats Pointer to the statistics structure
  */
-void complete_proc(proc_stats_t *p_stats) {
+void processor_t::complete(proc_stats_t *p_stats) {
+    // threads still running at the end ran for all of it
+    for(unsigned t = 0; t < threads.size(); t++){
+        if(!p_stats->thread_cycles[t]){
+            p_stats->thread_cycles[t] = p_stats->cycle_count;
+        }
+    }
     p_stats->avg_disp_size = p_stats->sum_disp_size / p_stats->cycle_count;
     p_stats->avg_inst_retired = p_stats->retired_instruction * 1.f / p_stats->cycle_count; 
 }
@@ -67,86 +178,330 @@ void complete_proc(proc_stats_t *p_stats) {
  *
  * @p_stats Pointer to the statistics structure
  */
-void run_proc(proc_stats_t* p_stats) {   
-    while (!cpu.finished) {
-        // invoke pipline for current cycle
-        state_update(p_stats, cycle_half_t::FIRST);
-        execute(p_stats, cycle_half_t::FIRST);
-        schedule(p_stats, cycle_half_t::FIRST);
-        dispatch(p_stats, cycle_half_t::FIRST);
-
-        state_update(p_stats, cycle_half_t::SECOND);
-
-        if (!cpu.finished){
-            execute(p_stats, cycle_half_t::SECOND);
-            schedule(p_stats, cycle_half_t::SECOND);
-            dispatch(p_stats, cycle_half_t::SECOND);
-            instr_fetch_and_decode(p_stats, cycle_half_t::SECOND);            
-        
-            p_stats->cycle_count++;
+void processor_t::run(proc_stats_t* p_stats) {   
+    // timing rows are written as instructions retire
+    text_timing_sink_t stdout_sink(stdout);
+    timing_sink_t* sink = timing_sink;
+    if(cpu.begin_dump > 0){
+        if(sink == NULL){
+            timing_sink = &stdout_sink;
         }
+        timing_sink->begin();
     }
+
+    (this->*kernel)(p_stats);
     
-    // print result
     if(cpu.begin_dump > 0){
+        timing_sink->end();
+        timing_sink = sink;
+    }
+}
+
+// trains the predictor and caches on the next n instructions of the first
+// thread without timing them
+uint64_t processor_t::warm(uint64_t n) {
+    trace_source_t* source = threads[0].source;
+    if(source == NULL){
+        return 0;
+    }
+    if(!predictor && !options.cache.enabled()){
+        return source->skip(n);
+    }
+    proc_inst_t inst;
+    uint64_t i = 0;
+    for(; i < n && source->read_instruction(&inst); i++){
+        if(predictor && (inst.flags & INST_BRANCH)){
+            predictor->predict(inst.instruction_address);
+            predictor->update(inst.instruction_address, inst.flags & INST_TAKEN);
+        }
+        if(options.cache.enabled() && (inst.flags & (INST_LOAD | INST_STORE))){
+            int level;
+            caches.access(inst.mem_addr, &level);
+        }
+    }
+    return i;
+}
+
+void processor_t::warm_in_flight(){
+    if(!options.cache.enabled()){
+        return;
+    }
+    // oldest first: the scheduling queue, then what is still waiting to dispatch
+    std::vector<inst_handle_t> dropped;
+    for(const inst_handle_t* h = scheduling_queue.begin(); h != scheduling_queue.end(); h++){
+        if(*h != NO_INST && !instrs[*h].fired){
+            dropped.push_back(*h);
+        }
+    }
+    for(unsigned t = 0; t < threads.size(); t++){
+        dropped.insert(dropped.end(), threads[t].dispatching_queue.begin(), threads[t].dispatching_queue.end());
+    }
+    for(size_t i = 0; i < dropped.size(); i++){
+        const proc_inst_t &inst = instrs[dropped[i]];
+        if(inst.flags & (INST_LOAD | INST_STORE)){
+            int level;
+            caches.access(inst.mem_addr, &level);
+        }
+    }
+}
+
+// every piece of state, in one order for both directions. false if the
+// snapshot has a different number of threads
+bool processor_t::checkpoint(checkpoint_io_t &io, proc_stats_t* p_stats) {
+    io.pod(*p_stats);
+    io.pod(options);
+    io.pod(cpu);
+    io.pod(stop_at);
+
+    instrs.checkpoint(io);
+    io.deq(dump_pending);
+    io.pod(next_dump_id);
+
+    if(!io.writing()){
+        predictor.reset(make_branch_predictor(options.bp_kind, options.bp_table_bits, options.bp_history_bits));
+    }
+    if(predictor){
+        predictor->checkpoint(io);
+    }
+    caches.checkpoint(io);
+
+    uint32_t n = threads.size();
+    io.pod(n);
+    if(n != threads.size()){
+        return false;
+    }
+    for(unsigned t = 0; t < threads.size(); t++){
+        hw_thread_t &thread = threads[t];
+        io.deq(thread.dispatching_queue);
+        io.pod(thread.register_file);
+        thread.rob.checkpoint(io);
+        io.map(thread.last_store);
+        io.pod(thread.fetched);
+        io.pod(thread.read_finished);
+        io.pod(thread.mispredict_pending);
+        io.pod(thread.fetch_resume_cycle);
+        io.pod(thread.icount);
+    }
+    io.pod(fetch_next);
+
+    scheduling_queue.checkpoint(io);
+    io.pod(scheduling_queue_limit);
+
+    io.vec(dispatched);
+    io.vec(woken);
+    for(int i = 0; i < NUM_FU_CLASSES; i++){
+        io.heap(ready[i]);
+    }
+    io.vec(executing);
+    io.heap(in_flight);
+    io.pod(in_flight_cnt);
+    io.vec(completed);
+    io.vec(retiring);
+    io.vec(mem_resolved);
+
+    cdb.checkpoint(io);
+    io.pod(fu_cnt);
+    return true;
+}
+
+bool processor_t::save_checkpoint(FILE* out, proc_stats_t* p_stats) {
+    checkpoint_io_t io(out, true);
+    uint32_t version = CHECKPOINT_VERSION;
+    io.bytes((void*)CHECKPOINT_MAGIC, 8);
+    io.pod(version);
+    return checkpoint(io, p_stats) && io.ok();
+}
+
+bool processor_t::restore_checkpoint(FILE* in, proc_stats_t* p_stats) {
+    checkpoint_io_t io(in, false);
+    char magic[8];
+    uint32_t version = 0;
+    io.bytes(magic, 8);
+    io.pod(version);
+    if(!io.ok() || memcmp(magic, CHECKPOINT_MAGIC, 8) != 0 || version != CHECKPOINT_VERSION){
+        return false;
+    }
+    if(!checkpoint(io, p_stats) || !io.ok()){
+        return false;
+    }
+    select_kernel();
+    // every thread carries on from the instruction after the last one it fetched
+    for(unsigned t = 0; t < threads.size(); t++){
+        trace_source_t* source = threads[t].source;
+        if(source == NULL || source->skip(threads[t].fetched) != threads[t].fetched){
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+  the first cycle, from the current one on, in which some stage has work to
+  do. nothing can happen while every event list is empty, no instruction
+  can move from the dispatching to the scheduling queue and fetch is held
+  back, until the next multi-cycle instruction finishes. returns the current
+  cycle when it is not idle, and also when nothing is in flight at all.
+*/
+uint64_t processor_t::next_event_cycle(proc_stats_t* p_stats) {
+    uint64_t now = p_stats->cycle_count;
+    if(!completed.empty() || !retiring.empty() || !executing.empty()
+       || !dispatched.empty() || !woken.empty() || !mem_resolved.empty()){
+        return now;
+    }
+    for(int i = 0; i < NUM_FU_CLASSES; i++){
+        if(!ready[i].empty()){
+            return now;
+        }
+    }
+    uint64_t next = UINT64_MAX;
+    for(unsigned t = 0; t < threads.size(); t++){
+        const hw_thread_t &thread = threads[t];
+        if(!thread.dispatching_queue.empty() && get_sqfree_slots() > 0 && get_rob_free_slots(thread) > 0){
+            return now;
+        }
+        if(!thread.rob.empty() && instrs[thread.rob.front()].cycle_status_update){
+            return now;
+        }
+        if(!thread.read_finished && (options.dispatch_queue_limit == 0
+                                     || thread.dispatching_queue.size() < options.dispatch_queue_limit)){
+            // unless it is waiting out a mispredict
+            if(!thread.mispredict_pending){
+                if(thread.fetch_resume_cycle <= now){
+                    return now;
+                }
+                next = std::min(next, thread.fetch_resume_cycle);
+            }
+        }
+    }
+    if(!in_flight.empty() && in_flight.top().first < next){
+        next = in_flight.top().first;
+    }
+    return next != UINT64_MAX && next > now ? next : now;
+}
+
+// jumps over idle cycles, accounting for them exactly as if they had been stepped
+void processor_t::fast_forward(proc_stats_t* p_stats) {
+    uint64_t next = next_event_cycle(p_stats);
+    if(next <= p_stats->cycle_count){
+        return;
+    }
+    uint64_t skipped = next - p_stats->cycle_count;
 
-/*for(unsigned i = 0; i < all_instrs.size(); i++){
-auto instr = all_instrs[i];
-if(instr->id >= cpu.begin_dump && instr->id <= cpu.end_dump){
-	std::cout<< instr->id << "\t"
-			 << instr->op_code<<"\t"
-			 << instr->dest_reg<<"\t"
-			 << instr->src_reg[0]<<"\t"
-			 << instr->src_reg[1] << std::endl;
-}
-}*/
-
-        std::cout << std::endl;
-        std::cout << "INST\tFETCH\tDISP\tSCHED\tEXEC\tSTATE" << std::endl;
-
-        for(unsigned i = 0; i < all_instrs.size(); i++){
-            auto instr = all_instrs[i];
-            if(instr->id >= cpu.begin_dump && instr->id <= cpu.end_dump){
-		//		std::cout<< instr->op_code<<"\t"
-		//				 << instr->dest_reg<<"\t"
-		//				 << instr->src_reg[0]<<"\t"
-		//				 << instr->src_reg[1] << std::endl;
-                std::cout << instr->id << "\t"
-                          << instr->cycle_fetch_decode << "\t" 
-                          << instr->cycle_dispatch << "\t"
-                          << instr->cycle_schedule << "\t"
-                          << instr->cycle_execute << "\t"
-                          << instr->cycle_status_update << std::endl;  
+    // dispatch (FIRST) samples the unchanging dispatch queues every cycle
+    uint64_t queued = queued_instructions();
+    if (p_stats->max_disp_size < queued)
+        p_stats->max_disp_size = queued;
+    p_stats->sum_disp_size += (double)queued * skipped;
+    if(detail){
+        // queues, units and waiting instructions all stay as they are
+        detail->dispatch_queue.add(queued, skipped);
+        detail->scheduling_queue.add(scheduling_queue.size(), skipped);
+        for(int i = 0; i < NUM_FU_CLASSES; i++){
+            if(!options.fu_pipelined[i]){
+                detail->fu_busy[i] += (uint64_t)in_flight_cnt[i] * skipped;
             }
         }
-        std::cout << std::endl;
+        detail->wait_operands += (uint64_t)(scheduling_queue.size() - in_flight.size()) * skipped;
+    }
+    if(rob_full()){
+        p_stats->rob_full_cycles += skipped;
+    }
+
+    // and fetch is held back every cycle, by a mispredict or the bounded queue
+    if(!cpu.read_finished){
+        if(mispredict_stalled(p_stats->cycle_count)){
+            p_stats->mispredict_stall_cycles += skipped;
+        }else{
+            p_stats->fetch_stall_cycles += skipped;
+        }
+    }
+    p_stats->cycle_count = next;
+}
+
+// releases a retired instruction, streaming its timing if it is in the dump window
+void processor_t::retire(inst_handle_t handle, proc_stats_t* p_stats) {
+    proc_inst_t* instr = &instrs[handle];
+    p_stats->thread_retired[instr->thread]++;
+    if(detail){
+        detail->dispatch_wait.add(instr->cycle_schedule - instr->cycle_dispatch);
+        detail->schedule_wait.add(instr->cycle_execute - instr->cycle_schedule);
+        detail->execute_time.add(instr->cycle_status_update - instr->cycle_execute);
+        detail->total_latency.add(instr->cycle_status_update - instr->cycle_fetch_decode);
+    }
+    if(cpu.begin_dump > 0 && instr->id >= cpu.begin_dump && instr->id <= cpu.end_dump){
+        uint64_t index = instr->id - next_dump_id;
+        if(dump_pending.size() <= index){
+            dump_pending.resize(index + 1);
+        }
+        inst_timing_t &t = dump_pending[index];
+        t.id = instr->id;
+        t.cycle_fetch_decode = instr->cycle_fetch_decode;
+        t.cycle_dispatch = instr->cycle_dispatch;
+        t.cycle_schedule = instr->cycle_schedule;
+        t.cycle_execute = instr->cycle_execute;
+        t.cycle_status_update = instr->cycle_status_update;
+
+        // write out the run of rows that is now complete
+        while(!dump_pending.empty() && dump_pending.front().id == next_dump_id){
+            timing_sink->write(dump_pending.front());
+            dump_pending.pop_front();
+            next_dump_id++;
+        }
+    }
+    instrs.release(handle);
+}
+
+// retires finished instructions from the head of each thread's reorder
+// buffer, in program order and at most commit_width of them
+void processor_t::commit(proc_stats_t* p_stats) {
+    for(unsigned t = 0; t < threads.size(); t++){
+        rob_t &rob = threads[t].rob;
+        uint32_t n = 0;
+        while(!rob.empty() && instrs[rob.front()].cycle_status_update
+              && (options.commit_width == 0 || n < options.commit_width)){
+            retire(rob.front(), p_stats);
+            rob.pop();
+            n++;
+        }
+        p_stats->retired_instruction += n;
     }
 }
 
 
 /** STATE UPDATE stage */
-void state_update(proc_stats_t* p_stats, const cycle_half_t &half) {
+void processor_t::state_update(proc_stats_t* p_stats, const cycle_half_t &half) {
     if (half == cycle_half_t::FIRST) {
 		if(debug){printf("state update: first half\n");}
-        // record instr entry cycle
-        for(unsigned i = 0; i < scheduling_queue.size(); i++){
-            auto instr = scheduling_queue[i];
-            if (instr->executed == true && !instr->cycle_status_update) {
-                instr->cycle_status_update = p_stats->cycle_count;              
-            }
-        }        
+        // record instr entry cycle for everything executed last cycle
+        for(unsigned i = 0; i < completed.size(); i++){
+            instrs[completed[i]].cycle_status_update = p_stats->cycle_count;
+        }
+        retiring.swap(completed);
+        completed.clear();
     } else {
 		if(debug){printf("state update: second half\n");}
         // delete instructions from scheduling queue
-        auto it = scheduling_queue.begin();
-        while(it != scheduling_queue.end()){
-            auto instr = *it;
-
-            if(instr->cycle_status_update){
-                it = scheduling_queue.erase(it);
-                p_stats->retired_instruction++;
-            }else{
-                it++;
+        if(!retiring.empty()){
+            for(unsigned i = 0; i < retiring.size(); i++){
+                scheduling_queue.remove(instrs, retiring[i]);
+            }
+            // without a reorder buffer they retire straight away
+            if(options.rob_size == 0){
+                for(unsigned i = 0; i < retiring.size(); i++){
+                    retire(retiring[i], p_stats);
+                }
+                p_stats->retired_instruction += retiring.size();
+            }
+            retiring.clear();
+        }
+        if(options.rob_size > 0){
+            commit(p_stats);
+        }
+        // note when each thread has retired its last instruction
+        for(unsigned t = 0; threads.size() > 1 && t < threads.size(); t++){
+            if(threads[t].read_finished && !p_stats->thread_cycles[t]
+               && p_stats->thread_retired[t] == threads[t].fetched){
+                p_stats->thread_cycles[t] = p_stats->cycle_count;
             }
         }
         
@@ -159,201 +514,449 @@ void state_update(proc_stats_t* p_stats, const cycle_half_t &half) {
 
 
 /** EXECUTE stage */
-void execute(proc_stats_t* p_stats, const cycle_half_t &half) {
+template <class S>
+void processor_t::execute_k(proc_stats_t* p_stats, const cycle_half_t &half) {
     if (half == cycle_half_t::FIRST) {
 		if(debug){printf("execute: first half\n");}
 		uint32_t bus_index = 0;
-        // record instr entry cycle
-        for(unsigned i = 0; i < scheduling_queue.size(); i++){
-            auto instr = scheduling_queue[i];            
-            if (instr->fired == true && !instr->cycle_execute) {
+        // multi-cycle instructions whose result is ready join the bus arbitration
+        unsigned old_executing = executing.size();
+        while(!in_flight.empty() && in_flight.top().first <= p_stats->cycle_count){
+            inst_handle_t handle = (inst_handle_t)in_flight.top().second;
+            in_flight.pop();
+            in_flight_cnt[instrs[handle].op_code]--;
+            executing.push_back(handle);
+        }
+        merge_executing(old_executing);
+        // record instr entry cycle. fired instructions take the result buses
+        // in program order; the ones left without a bus stall in their FU.
+        unsigned stalled = 0;
+        for(unsigned i = 0; i < executing.size(); i++){
+            inst_handle_t handle = executing[i];
+            proc_inst_t* instr = &instrs[handle];
+            if (!instr->cycle_execute) {
                 instr->cycle_execute = p_stats->cycle_count;                  
             }
-			if(instr->fired && !instr->executed){
-				if( (instr->dest_reg != -1) && ( bus_index < cdb.size()) ){ 
-					cdb[bus_index].free = false;
-					cdb[bus_index].reg = instr->dest_reg;
-					cdb[bus_index].tag = instr->id;
-					//instr->cdb_written = true;
-					instr->executed = true;   
-					bus_index++;
-				}else if(instr->dest_reg == -1){// no bus usage
-					instr->executed = true;
-				}	
+			if( (instr->dest_reg != -1) && ( bus_index < S::buses(cdb.buses)) ){ 
+				cdb.reg[bus_index] = instr->dest_reg;
+				cdb.tag[bus_index] = instr->id;
+				cdb.producer[bus_index] = handle;
+				//instr->cdb_written = true;
+				instr->executed = true;   
+				bus_index++;
+			}else if(instr->dest_reg == -1){// no bus usage
+				instr->executed = true;
+			}
+			if(instr->executed){
+				resolve(handle, p_stats->cycle_count);
+				completed.push_back(handle);
+			}else{
+				executing[stalled++] = handle;
 			}
         }
+        executing.resize(stalled);
+        if(detail){
+            for(uint32_t b = 0; b < bus_index; b++){
+                detail->cdb_busy[b < STATS_MAX_BUSES ? b : STATS_MAX_BUSES - 1]++;
+            }
+        }
     } else {
 		if(debug){printf("execute: second half\n");}
     }
 }
 
+// lets fetch go on past a mispredicted branch and releases the loads
+// waiting on a store, now that the instruction has executed
+void processor_t::resolve(inst_handle_t handle, uint64_t cycle) {
+    proc_inst_t* instr = &instrs[handle];
+    hw_thread_t &thread = threads[instr->thread];
+    if(instr->flags & INST_MISPREDICTED){
+        thread.mispredict_pending = false;
+        thread.fetch_resume_cycle = cycle + 1 + options.mispredict_penalty;
+    }
+    std::unordered_map<uint64_t, inst_handle_t> &last_store = thread.last_store;
+    if(options.mem_dependences && (instr->flags & INST_STORE)){
+        std::unordered_map<uint64_t, inst_handle_t>::iterator it = last_store.find(instr->mem_addr);
+        if(it != last_store.end() && it->second == handle){
+            last_store.erase(it);
+        }
+        for(uint32_t link = instr->mem_waiters; link; link = instrs[link - 1].next_mem_waiter){
+            mem_resolved.push_back(link - 1);
+        }
+        instr->mem_waiters = 0;
+    }
+}
+
+// hands a broadcast result to the instructions waiting on it
+void processor_t::wakeup(uint32_t bus) {
+    proc_inst_t* producer = &instrs[cdb.producer[bus]];
+    uint32_t link = producer->consumers;
+    producer->consumers = 0;
+    while(link){
+        inst_handle_t handle = (link - 1) >> 1;
+        int k = (link - 1) & 1;
+        proc_inst_t* instr = &instrs[handle];
+        link = instr->next_consumer[k];
+
+        if( !instr->src_ready[k] && instr->src_tag[k] == cdb.tag[bus]){
+            if((uint32_t)instr->src_reg[k] != cdb.reg[bus]){
+                printf("schedule queue: this cannot happen\n");
+            }
+            instr->src_ready[k] = true;
+            if(instr->src_ready[0] && instr->src_ready[1] && instr->mem_ready){
+                woken.push_back(handle);
+            }
+        }
+    }
+}
+
+void processor_t::sort_by_id(std::vector<inst_handle_t> &handles) {
+    if(handles.size() < 2)
+        return;
+    std::vector<uint64_t> keys(handles.size());
+    for(unsigned i = 0; i < handles.size(); i++){
+        keys[i] = order_key(handles[i]);
+    }
+    std::sort(keys.begin(), keys.end());
+    for(unsigned i = 0; i < handles.size(); i++){
+        handles[i] = (inst_handle_t)keys[i];
+    }
+}
+
+// sorts the handles appended after old_size by id and merges them into the
+// already ordered executing list
+void processor_t::merge_executing(unsigned old_size) {
+    if(executing.size() == old_size)
+        return;
+    std::vector<inst_handle_t> fired(executing.begin() + old_size, executing.end());
+    sort_by_id(fired);
+    std::copy(fired.begin(), fired.end(), executing.begin() + old_size);
+    std::inplace_merge(executing.begin(), executing.begin() + old_size, executing.end(),
+        [this](inst_handle_t a, inst_handle_t b) { return instrs[a].id < instrs[b].id; });
+}
+
+// looks a load or store up in the caches as it fires
+uint32_t processor_t::mem_latency(inst_handle_t handle, proc_stats_t* p_stats) {
+    int level;
+    uint32_t latency = caches.access(instrs[handle].mem_addr, &level);
+    for(int i = 0; i < CACHE_LEVELS && i <= level && options.cache.level[i].size > 0; i++){
+        p_stats->cache_accesses[i]++;
+    }
+    if(level < CACHE_LEVELS){
+        p_stats->cache_hits[level]++;
+    }
+    return latency;
+}
+
 /** SCHEDULE stage */
-void schedule(proc_stats_t* p_stats, const cycle_half_t &half) {
+template <class S>
+void processor_t::schedule_k(proc_stats_t* p_stats, const cycle_half_t &half) {
     if (half == cycle_half_t::FIRST) {
 		if(debug){printf("schedule: first half\n");}
         // record instr entry cycle
-        for(unsigned i = 0; i < scheduling_queue.size(); i++){
-            auto instr = scheduling_queue[i];            
-            if (instr->fire)
-                continue;
-    
-            if (!instr->cycle_schedule) {
-                instr->cycle_schedule = p_stats->cycle_count;                 
-            } 
-
+        for(unsigned i = 0; i < dispatched.size(); i++){
+            proc_inst_t* instr = &instrs[dispatched[i]];
+            instr->cycle_schedule = p_stats->cycle_count;                 
 			//if there are no dependencies,  fire
-			if(instr->src_ready[0] && instr->src_ready[1]){
+			if(instr->src_ready[0] && instr->src_ready[1] && instr->mem_ready){
 				instr->fire = true;
+				ready[instr->op_code].push(order_key(dispatched[i]));
 			}
-        } 
+        }
+        dispatched.clear();
+
+        // operands delivered by last cycle's broadcast
+        for(unsigned i = 0; i < woken.size(); i++){
+            proc_inst_t* instr = &instrs[woken[i]];
+            instr->fire = true;
+            ready[instr->op_code].push(order_key(woken[i]));
+        }
+        woken.clear();
     } else {        
 		if(debug){printf("schedule: second half\n");}
-		uint32_t fu_used_cnt[3] = {0,0,0};
+		uint32_t fu_used_cnt[NUM_FU_CLASSES] = {0,0,0};
 		
-		//update the schedule queue via cdb
-		for(uint32_t i=0; i< scheduling_queue.size(); i++){
-			auto instr = scheduling_queue[i];
-			if(!instr->fire){
-				for(uint32_t j = 0; j < cdb.size(); j++){
-					if(!cdb[j].free){
-						for(int k=0;k<2;k++){
-							if( !instr->src_ready[k] && instr->src_tag[k] == cdb[j].tag){
-								if((uint32_t)instr->src_reg[k] != cdb[j].reg){
-									printf("schedule queue: this cannot happen\n");
-								}
-								instr->src_ready[k] = true;
-							}
-						}
-					}
-				}
+		//update the schedule queue via cdb, touching only the waiting consumers
+		for(uint32_t j = 0; j < S::buses(cdb.buses); j++){
+			if(!cdb.free(j)){
+				wakeup(j);
 			}
 		}
+		// and the loads whose store has executed
+        for(unsigned i = 0; i < mem_resolved.size(); i++){
+            proc_inst_t* instr = &instrs[mem_resolved[i]];
+            instr->mem_ready = true;
+            if(instr->src_ready[0] && instr->src_ready[1]){
+                woken.push_back(mem_resolved[i]);
+            }
+        }
+        mem_resolved.clear();
 		//find executed instructions still stalled in functional units
-        for(unsigned i = 0; i < scheduling_queue.size(); i++){
-			auto instr = scheduling_queue[i];
-			if (instr->cycle_execute && !instr->executed){
-				//assert(instr->executed);
-				fu_used_cnt[instr->op_code]++;
-			}
+        for(unsigned i = 0; i < executing.size(); i++){
+			fu_used_cnt[instrs[executing[i]].op_code]++;
 		}
-		//printf("cycle : %ld , used :  %d , %d, %d \n ", p_stats->cycle_count, fu_used_cnt[0],fu_used_cnt[1],fu_used_cnt[2]);
-        // fire all marked instructions if possible
-        for(unsigned i = 0; i < scheduling_queue.size(); i++){
-            auto instr = scheduling_queue[i];            
-            if (instr->fire && !instr->fired) {                
+        // a unit that is not pipelined stays busy until its instruction is done
+        for(int fu_index = 0; fu_index < NUM_FU_CLASSES; fu_index++){
+            if(!options.fu_pipelined[fu_index]){
+                fu_used_cnt[fu_index] += in_flight_cnt[fu_index];
+            }
+        }
+        // fire the oldest marked instructions of each FU class while units are free
+        unsigned old_executing = executing.size();
+        for(int fu_index = 0; fu_index < NUM_FU_CLASSES; fu_index++){
+            while(!ready[fu_index].empty() && fu_used_cnt[fu_index] < S::fu(fu_index, fu_cnt[fu_index])){
+                inst_handle_t handle = (inst_handle_t)ready[fu_index].top();
+                ready[fu_index].pop();
 				// if no structural hazards, move in to fired state. ready to exec.
-				int fu_index = instr->op_code;
-				if(fu_used_cnt[fu_index] < fu_cnt[fu_index]){
-					instr->fired = true;
-					fu_used_cnt[fu_index]++;	
-				}
+                instrs[handle].fired = true;
+                threads[instrs[handle].thread].icount--;
+                fu_used_cnt[fu_index]++;
+                uint32_t latency = options.fu_latency[fu_index];
+                if(options.cache.enabled() && (instrs[handle].flags & (INST_LOAD | INST_STORE))){
+                    latency += mem_latency(handle, p_stats);
+                }
+                if(latency > 1){
+                    // executes from next cycle on, result ready latency cycles after firing
+                    instrs[handle].cycle_execute = p_stats->cycle_count + 1;
+                    in_flight.push(std::make_pair(p_stats->cycle_count + latency, order_key(handle)));
+                    in_flight_cnt[fu_index]++;
+                }else{
+                    executing.push_back(handle);
+                }
+            }
+        }
+        // keep the executing list in program order for bus arbitration
+        merge_executing(old_executing);
+
+        if(detail){
+            // what is left in the queue did not fire this cycle
+            uint64_t not_fired = scheduling_queue.size() - executing.size() - in_flight.size() - completed.size();
+            for(int fu_index = 0; fu_index < NUM_FU_CLASSES; fu_index++){
+                detail->fu_busy[fu_index] += fu_used_cnt[fu_index];
+                detail->wait_structural += ready[fu_index].size();
+                not_fired -= ready[fu_index].size();
             }
+            detail->wait_operands += not_fired;
+        }
+    }
+}
+
+/*
+  bit i of the result is set when bus base + i carries the tag its register
+  is still waiting for, comparing CDB_LANES buses at once
+*/
+static inline uint32_t cdb_match(const proc_cdb_t &cdb, uint32_t base, const uint32_t* rf_tag) {
+#if defined(__AVX2__)
+    __m256i regs = _mm256_loadu_si256((const __m256i*)&cdb.reg[base]);
+    __m256i tags = _mm256_loadu_si256((const __m256i*)&cdb.tag[base]);
+    __m256i want = _mm256_i32gather_epi32((const int*)rf_tag, regs, 4);
+    __m256i busy = _mm256_cmpeq_epi32(tags, _mm256_setzero_si256());
+    __m256i hit = _mm256_andnot_si256(busy, _mm256_cmpeq_epi32(tags, want));
+    return _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+#elif defined(__SSE2__)
+    uint32_t mask = 0;
+    for(uint32_t i = 0; i < CDB_LANES; i += 4){
+        const uint32_t* reg = &cdb.reg[base + i];
+        __m128i tags = _mm_loadu_si128((const __m128i*)&cdb.tag[base + i]);
+        __m128i want = _mm_set_epi32(rf_tag[reg[3]], rf_tag[reg[2]], rf_tag[reg[1]], rf_tag[reg[0]]);
+        __m128i busy = _mm_cmpeq_epi32(tags, _mm_setzero_si128());
+        __m128i hit = _mm_andnot_si128(busy, _mm_cmpeq_epi32(tags, want));
+        mask |= _mm_movemask_ps(_mm_castsi128_ps(hit)) << i;
+    }
+    return mask;
+#else
+    uint32_t mask = 0;
+    for(uint32_t i = 0; i < CDB_LANES; i++){
+        uint32_t tag = cdb.tag[base + i];
+        if(tag != 0 && rf_tag[cdb.reg[base + i]] == tag){
+            mask |= 1u << i;
         }
-		//printf("cycle : %ld , final :  %d , %d, %d \n ", p_stats->cycle_count, fu_used_cnt[0],fu_used_cnt[1],fu_used_cnt[2]);
     }
+    return mask;
+#endif
 }
 
 /** DISPATCH stage */
-void dispatch(proc_stats_t* p_stats, const cycle_half_t &half) {
+template <class S>
+void processor_t::dispatch_k(proc_stats_t* p_stats, const cycle_half_t &half) {
     if (half == cycle_half_t::FIRST) {    
 		if(debug){printf("dispatch: first half\n");}
-        if (p_stats->max_disp_size < dispatching_queue.size())
-            p_stats->max_disp_size = dispatching_queue.size();
+        uint64_t queued = queued_instructions();
+        if (p_stats->max_disp_size < queued)
+            p_stats->max_disp_size = queued;
             
-        p_stats->sum_disp_size += dispatching_queue.size();
+        p_stats->sum_disp_size += queued;
+        if(detail){
+            detail->dispatch_queue.add(queued);
+            detail->scheduling_queue.add(scheduling_queue.size());
+        }
 	
 		// we find out the number of free slots in the scheduling queue and fill them up
-		// with dispatching queue in-order	
+		// with dispatching queue in-order, the oldest of any thread first, as far
+		// as each thread's reorder buffer has room
 		uint32_t free_sq_slots = get_sqfree_slots();
-        for(unsigned i = 0; i < dispatching_queue.size(); i++){
-            auto instr = dispatching_queue[i];            
-			if(free_sq_slots > 0){
-				instr->reserved = true;
-				free_sq_slots--;
-			}
+		if(rob_full()){
+			p_stats->rob_full_cycles++;
+		}
+		uint64_t next[PROC_MAX_THREADS], limit[PROC_MAX_THREADS];
+		for(unsigned t = 0; t < threads.size(); t++){
+			next[t] = 0;
+			limit[t] = std::min<uint64_t>(threads[t].dispatching_queue.size(), get_rob_free_slots(threads[t]));
+		}
+        for(; free_sq_slots > 0; free_sq_slots--){
+            int oldest = -1;
+            for(unsigned t = 0; t < threads.size(); t++){
+                if(next[t] < limit[t] && (oldest < 0 || instrs[threads[t].dispatching_queue[next[t]]].id
+                                          < instrs[threads[oldest].dispatching_queue[next[oldest]]].id)){
+                    oldest = t;
+                }
+            }
+            if(oldest < 0){
+                break;
+            }
+            instrs[threads[oldest].dispatching_queue[next[oldest]++]].reserved = true;
         }
 	   //printf("current cycle : %ld\n", p_stats->cycle_count); 
        //print_cdb();
 	   //print_register_file();
 
         //update the register file via result bus
-		for(uint32_t i=0; i< cdb.size();i++){
-			if(!cdb[i].free){//cdb valid
-				uint32_t reg = cdb[i].reg;
-				uint32_t tag = cdb[i].tag;
-				if(register_file[reg].tag == tag){
-					if(register_file[reg].ready){
+        if(threads.size() == 1){
+			register_file_t &register_file = threads[0].register_file;
+			for(uint32_t base = 0; base < S::buses(cdb.buses); base += CDB_LANES){
+				uint32_t hits = cdb_match(cdb, base, register_file.tag);
+				while(hits){
+					uint32_t reg = cdb.reg[base + __builtin_ctz(hits)];
+					hits &= hits - 1;
+					if(register_file.ready[reg]){
 						printf("cycle number : %ld\n", p_stats->cycle_count);
 						std::cout<< "register file: cannot happen"<<std::endl;
 						//print_cdb();	
 						//print_register_file();
 						//assert(true);
 					}
-					register_file[reg].ready = true;
+					register_file.ready[reg] = true;
 				}
 			}
-		}
+        }else{
+            // each result goes to the register file of the thread that produced it
+            for(uint32_t b = 0; b < S::buses(cdb.buses); b++){
+                if(!cdb.free(b)){
+                    register_file_t &register_file = threads[instrs[cdb.producer[b]].thread].register_file;
+                    if(register_file.tag[cdb.reg[b]] == cdb.tag[b]){
+                        register_file.ready[cdb.reg[b]] = true;
+                    }
+                }
+            }
+        }
 
     } else {
 		if(debug){printf("dispatch: second half\n");}
-        while (!dispatching_queue.empty()) {
-            auto instr = dispatching_queue.front();
+        for(unsigned t = 0; t < threads.size(); t++){
+            hw_thread_t &thread = threads[t];
+            std::deque<inst_handle_t> &dispatching_queue = thread.dispatching_queue;
+            register_file_t &register_file = thread.register_file;
+            std::unordered_map<uint64_t, inst_handle_t> &last_store = thread.last_store;
+            while (!dispatching_queue.empty()) {
+                inst_handle_t handle = dispatching_queue.front();
+                proc_inst_t* instr = &instrs[handle];
             
-            if (!instr->reserved)
-                break;
-            //populate the dependencies of the instruciton
-			for(int i=0;i<2;i++){
-				int32_t src_reg = instr->src_reg[i];
-				if(src_reg != -1){
-					if(register_file[src_reg].ready){
-						instr->src_ready[i] = true;
+                if (!instr->reserved)
+                    break;
+                //populate the dependencies of the instruciton
+				for(int i=0;i<2;i++){
+					int32_t src_reg = instr->src_reg[i];
+					if(src_reg != -1){
+						if(register_file.ready[src_reg]){
+							instr->src_ready[i] = true;
+						}else{
+							instr->src_ready[i] = false;
+							instr->src_tag[i] = register_file.tag[src_reg];
+							// wait on the producer's broadcast
+							proc_inst_t* producer = &instrs[register_file.producer[src_reg]];
+							instr->next_consumer[i] = producer->consumers;
+							producer->consumers = (handle << 1 | i) + 1;
+						}
 					}else{
-						instr->src_ready[i] = false;
-						instr->src_tag[i] = register_file[src_reg].tag;
+						instr->src_ready[i] = true;
 					}
-				}else{
-					instr->src_ready[i] = true;
+				} 
+				// if the instruction produces result, make destination register wait.
+				if(instr->dest_reg != -1){
+					register_file.tag[instr->dest_reg] = instr->id;
+					register_file.ready[instr->dest_reg] = false; 
+					register_file.producer[instr->dest_reg] = handle;
 				}
-			} 
-			// if the instruction produces result, make destination register wait.
-			if(instr->dest_reg != -1){
-				register_file[instr->dest_reg].tag = instr->id;
-				register_file[instr->dest_reg].ready = false; 
-			}
-			// remove from the dispatch queue and insert in to schedule queue
-            scheduling_queue.push_back(instr);            
-            dispatching_queue.pop_front();
-        }        
+				// a load waits on the youngest older store to its address
+				if(options.mem_dependences && (instr->flags & (INST_LOAD | INST_STORE))){
+					std::unordered_map<uint64_t, inst_handle_t>::iterator it = last_store.find(instr->mem_addr);
+					if((instr->flags & INST_LOAD) && it != last_store.end()){
+						proc_inst_t* store = &instrs[it->second];
+						instr->mem_ready = false;
+						instr->next_mem_waiter = store->mem_waiters;
+						store->mem_waiters = handle + 1;
+						p_stats->mem_dep_loads++;
+					}
+					if(instr->flags & INST_STORE){
+						last_store[instr->mem_addr] = handle;
+					}
+				}
+				// remove from the dispatch queue and insert in to schedule queue
+                scheduling_queue.push(instrs, handle);
+                if(options.rob_size > 0){
+                    thread.rob.push(handle);
+                }
+                dispatched.push_back(handle);
+                dispatching_queue.pop_front();
+            }        
+        }
 		
 		//clear the cdb
 		//printf("clearing cdb...\n");
-		for(uint32_t i = 0; i < cdb.size();i++){
-			cdb[i].free = true;
-			cdb[i].reg = 0;
-			cdb[i].tag = 0;
-		}
+		cdb.clear();
 		//print_cdb();
     }
 }
 /** INSTR-FETCH & DECODE stage */
-// dispatching queue is infinite. So push new instruction block F each time.
-void instr_fetch_and_decode(proc_stats_t* p_stats, const cycle_half_t &half) {
+// unless a dispatch queue limit is set the dispatching queue is infinite, so
+// push new instruction block F each time. otherwise fetch only what fits.
+template <class S>
+void processor_t::fetch_k(proc_stats_t* p_stats, const cycle_half_t &half) {
     if (half == cycle_half_t::SECOND) {          
 		if(debug){printf("instruction fetch: second half\n");}
-        // read the next instructions 
-        if (!cpu.read_finished){
-            for (uint64_t i = 0; i < cpu.f; i++) { 
-                proc_inst_ptr_t instr = proc_inst_ptr_t(new proc_inst_t());
-              
-                all_instrs.push_back(instr);
-                                
-                if (read_instruction(instr.get())) { 
+        // read the next instructions, all from the one thread the fetch policy picks
+        int t = cpu.read_finished ? -1 : select_fetch_thread(p_stats->cycle_count);
+        if (!cpu.read_finished && t < 0){
+            // nothing past a mispredicted branch until it resolves, or a full queue
+            if (mispredict_stalled(p_stats->cycle_count)) {
+                p_stats->mispredict_stall_cycles++;
+            } else {
+                p_stats->fetch_stall_cycles++;
+            }
+        } else if (t >= 0){
+            hw_thread_t &thread = threads[t];
+            uint64_t fetch_cnt = S::fetch(cpu.f);
+            if (options.dispatch_queue_limit > 0) {
+                // there is room for at least one, or the thread would not fetch
+                uint64_t room = options.dispatch_queue_limit - thread.dispatching_queue.size();
+                if (room < fetch_cnt) {
+                    p_stats->fetch_throttle_cycles++;
+                    fetch_cnt = room;
+                }
+            }
+            for (uint64_t i = 0; i < fetch_cnt; i++) { 
+                inst_handle_t handle = instrs.alloc();
+                proc_inst_t* instr = &instrs[handle];
+
+                if (thread.source != NULL && thread.source->read_instruction(instr)) { 
                     // reset counters
                     instr->id = cpu.read_cnt + 1;
+                    instr->thread = t;
 
                     instr->fire = false;
                     instr->fired = false;
                     instr->executed = false;
+                    instr->mem_ready = true;
 
                     instr->cycle_fetch_decode = p_stats->cycle_count;
                     instr->cycle_dispatch = p_stats->cycle_count + 1;
@@ -361,12 +964,33 @@ void instr_fetch_and_decode(proc_stats_t* p_stats, const cycle_half_t &half) {
                     instr->cycle_execute = 0;
                     instr->cycle_status_update = 0;                               
                     
-                    dispatching_queue.push_back(instr);                                              
+                    // predict the branch, and train the predictor, as it is fetched
+                    if (instr->flags & INST_BRANCH) {
+                        p_stats->branches++;
+                        bool taken = instr->flags & INST_TAKEN;
+                        if (predictor && predictor->predict(instr->instruction_address) != taken) {
+                            instr->flags |= INST_MISPREDICTED;
+                            p_stats->mispredictions++;
+                            thread.mispredict_pending = true;
+                        }
+                        if (predictor)
+                            predictor->update(instr->instruction_address, taken);
+                    }
+
+                    thread.dispatching_queue.push_back(handle);
+                    thread.fetched++;
+                    thread.icount++;
                     cpu.read_cnt++;                     
+                    if (thread.mispredict_pending)
+                        break;
                 } else {
-                    all_instrs.pop_back();
-                
-                    cpu.read_finished = true;  
+                    instrs.release(handle);
+
+                    thread.read_finished = true;  
+                    cpu.read_finished = true;
+                    for (unsigned i = 0; i < threads.size(); i++) {
+                        cpu.read_finished = cpu.read_finished && threads[i].read_finished;
+                    }
                     break;
                 }
             }
@@ -376,10 +1000,9 @@ void instr_fetch_and_decode(proc_stats_t* p_stats, const cycle_half_t &half) {
 
 
 /*
-  we scan through the scheduling queue and find out how many instructions
-  slots are free. 
+  find out how many instruction slots are free in the scheduling queue.
 */
-int get_sqfree_slots(){
+int processor_t::get_sqfree_slots(){
 	if(scheduling_queue.size() > scheduling_queue_limit){
 		printf("exceeded the limit in scheduling queue\n");
 		assert(true);
@@ -387,24 +1010,160 @@ int get_sqfree_slots(){
 	return (scheduling_queue_limit - scheduling_queue.size());
 }
 
+// unlimited without a reorder buffer
+uint32_t processor_t::get_rob_free_slots(const hw_thread_t &thread){
+	if(options.rob_size == 0){
+		return UINT32_MAX;
+	}
+	return thread.rob.capacity() - thread.rob.size();
+}
+
+// true if some thread has instructions to dispatch and its reorder buffer is full
+bool processor_t::rob_full(){
+    for(unsigned t = 0; options.rob_size > 0 && t < threads.size(); t++){
+        if(!threads[t].dispatching_queue.empty() && get_rob_free_slots(threads[t]) == 0){
+            return true;
+        }
+    }
+    return false;
+}
+
+// in the dispatch queues of all threads
+uint64_t processor_t::queued_instructions(){
+    uint64_t n = 0;
+    for(unsigned t = 0; t < threads.size(); t++){
+        n += threads[t].dispatching_queue.size();
+    }
+    return n;
+}
+
+// true if the thread has instructions left, is not held back by a
+// mispredict and has room in its dispatch queue
+bool processor_t::fetch_ready(const hw_thread_t &thread, uint64_t cycle){
+    return !thread.read_finished && !thread.mispredict_pending && cycle >= thread.fetch_resume_cycle
+        && (options.dispatch_queue_limit == 0 || thread.dispatching_queue.size() < options.dispatch_queue_limit);
+}
+
+// true if some thread with instructions left is waiting out a mispredict
+bool processor_t::mispredict_stalled(uint64_t cycle){
+    for(unsigned t = 0; t < threads.size(); t++){
+        const hw_thread_t &thread = threads[t];
+        if(!thread.read_finished && (thread.mispredict_pending || cycle < thread.fetch_resume_cycle)){
+            return true;
+        }
+    }
+    return false;
+}
+
+// the thread to fetch from this cycle, -1 if none can. the search starts
+// after the thread that fetched last
+int processor_t::select_fetch_thread(uint64_t cycle){
+    int chosen = -1;
+    uint32_t n = threads.size();
+    for(uint32_t i = 0; i < n; i++){
+        uint32_t t = fetch_next + i < n ? fetch_next + i : fetch_next + i - n;
+        if(!fetch_ready(threads[t], cycle)){
+            continue;
+        }
+        if(options.fetch_policy == FETCH_ROUND_ROBIN){
+            chosen = t;
+            break;
+        }
+        if(chosen < 0 || threads[t].icount < threads[chosen].icount){
+            chosen = t;
+        }
+    }
+    if(chosen >= 0){
+        fetch_next = chosen + 1 < (int)n ? chosen + 1 : 0;
+    }
+    return chosen;
+}
+
+// the cycle loop of run(), with the stages built for machine shape S
+template <class S>
+void processor_t::run_cycles(proc_stats_t* p_stats) {
+    while (!cpu.finished && (stop_at == 0 || p_stats->retired_instruction < stop_at)) {
+        // skip cycles in which no stage can change anything
+        fast_forward(p_stats);
+
+        // invoke pipline for current cycle
+        TIMED_STAGE(STAGE_STATE_UPDATE, state_update(p_stats, cycle_half_t::FIRST));
+        TIMED_STAGE(STAGE_EXECUTE, execute_k<S>(p_stats, cycle_half_t::FIRST));
+        TIMED_STAGE(STAGE_SCHEDULE, schedule_k<S>(p_stats, cycle_half_t::FIRST));
+        TIMED_STAGE(STAGE_DISPATCH, dispatch_k<S>(p_stats, cycle_half_t::FIRST));
+
+        TIMED_STAGE(STAGE_STATE_UPDATE, state_update(p_stats, cycle_half_t::SECOND));
+
+        if (!cpu.finished){
+            TIMED_STAGE(STAGE_EXECUTE, execute_k<S>(p_stats, cycle_half_t::SECOND));
+            TIMED_STAGE(STAGE_SCHEDULE, schedule_k<S>(p_stats, cycle_half_t::SECOND));
+            TIMED_STAGE(STAGE_DISPATCH, dispatch_k<S>(p_stats, cycle_half_t::SECOND));
+            TIMED_STAGE(STAGE_FETCH, fetch_k<S>(p_stats, cycle_half_t::SECOND));
+        
+            p_stats->cycle_count++;
+        }
+    }
+}
+
+/*
+  the shapes run most often get a kernel of their own; everything else runs
+  on the generic one. the results are the same either way.
+*/
+#define SHAPE_KERNEL(R, K0, K1, K2, F) \
+    if(cdb.buses == R && fu_cnt[0] == K0 && fu_cnt[1] == K1 && fu_cnt[2] == K2 && cpu.f == F){ \
+        kernel = &processor_t::run_cycles<fixed_shape_t<R, K0, K1, K2, F> >; \
+        return; \
+    }
+
+void processor_t::select_kernel() {
+    kernel = &processor_t::run_cycles<runtime_shape_t>;
+    if(options.generic_kernel){
+        return;
+    }
+    SHAPE_KERNEL(3, 2, 1, 2, 4)
+    SHAPE_KERNEL(8, 1, 2, 3, 4)
+    SHAPE_KERNEL(1, 1, 1, 1, 2)
+    SHAPE_KERNEL(8, 4, 4, 4, 8)
+}
+
+bool processor_t::specialized_kernel() const {
+    return kernel != &processor_t::run_cycles<runtime_shape_t>;
+}
+
+// the stages one at a time, on the generic kernel
+void processor_t::execute(proc_stats_t* p_stats, const cycle_half_t &half) {
+    execute_k<runtime_shape_t>(p_stats, half);
+}
+
+void processor_t::schedule(proc_stats_t* p_stats, const cycle_half_t &half) {
+    schedule_k<runtime_shape_t>(p_stats, half);
+}
+
+void processor_t::dispatch(proc_stats_t* p_stats, const cycle_half_t &half) {
+    dispatch_k<runtime_shape_t>(p_stats, half);
+}
+
+void processor_t::instr_fetch_and_decode(proc_stats_t* p_stats, const cycle_half_t &half) {
+    fetch_k<runtime_shape_t>(p_stats, half);
+}
 
 
-void print_register_file(){
+void processor_t::print_register_file(){
     int i = 19;	
 	printf("printing register file\n");
-	printf("%d : %d   %ld\n",i, register_file[i].ready, register_file[i].tag);	
+	printf("%d : %d   %u\n",i, threads[0].register_file.ready[i], threads[0].register_file.tag[i]);	
    // for(int i = 0; i < 64; i++){
-	//	printf("%d : %d   %ld\n",i, register_file[i].ready, register_file[i].tag);	
+	//	printf("%d : %d   %u\n",i, register_file.ready[i], register_file.tag[i]);	
 	//}
 	std::cout<<std::endl;
 }
 
 
 
-void print_cdb(){
+void processor_t::print_cdb(){
 	printf("printing cdb\n");
-	for(int i=0;i<cdb.size();i++){
-        printf("%d : %d  %d  %d \n", i, cdb[i].free , cdb[i].reg , cdb[i].tag);
+	for(uint32_t i=0;i<cdb.buses;i++){
+        printf("%u : %d  %u  %u \n", i, cdb.free(i) , cdb.reg[i] , cdb.tag[i]);
 	}
 	//std::cout<<std::endl;
 }
@@ -7,16 +7,37 @@
 #define DEFAULT_R 8
 #define DEFAULT_F 4
 
+// registers are a uint8_t in Trace_Rec, so every one of them fits
+#define PROC_NUM_REGS 256
+#define NUM_FU_CLASSES 3
+// result buses are padded to a multiple of the widest tag compare
+#define CDB_LANES 8
+// hardware threads sharing one back end
+#define PROC_MAX_THREADS 16
+// bump whenever a change alters the results of any configuration: it keys
+// the result cache, so older results are not reused
+#define PROCSIM_MODEL_VERSION 1
+
 #include <cstdint>
 #include <cstdio>
 #include <iostream>
 #include <fstream>
 #include <vector>
 #include <deque>
+#include <queue>
+#include <functional>
+#include <algorithm>
 #include <memory>
+#include <string>
 #include <utility>
 #include <unordered_map>
 #include <unordered_set>
+#ifdef PROCSIM_STAGE_TIMERS
+#include <chrono>
+#endif
+#include "branch_predictor.hpp"
+#include "cache.hpp"
+#include "checkpoint.hpp"
 
 typedef enum Op_Type_Enum{
     OP_ALU,             // ALU(ADD/ SUB/ MUL/ DIV) operaiton
@@ -29,6 +50,16 @@ typedef enum Op_Type_Enum{
 
 enum cycle_half_t { FIRST, SECOND };
 
+// the stages, as counted by the optional per-stage timers
+enum proc_stage_t {
+    STAGE_STATE_UPDATE,
+    STAGE_EXECUTE,
+    STAGE_SCHEDULE,
+    STAGE_DISPATCH,
+    STAGE_FETCH,
+    NUM_STAGES
+};
+
 /* Data structure for Trace Record */ 
 typedef struct Trace_Rec_Struct {
     uint64_t inst_addr;  // instruction address 
@@ -48,6 +79,14 @@ typedef struct Trace_Rec_Struct {
     uint64_t br_target;  // Target Address of Branch
 } Trace_Rec;
 
+// proc_inst_t::flags, from the trace
+#define INST_BRANCH  0x1
+#define INST_TAKEN   0x2
+#define INST_LOAD    0x4
+#define INST_STORE   0x8
+// set by fetch on a branch the predictor got wrong
+#define INST_MISPREDICTED 0x10
+
 // our extended instruction structure
 typedef struct _proc_inst_t
 {
@@ -55,10 +94,14 @@ typedef struct _proc_inst_t
     int32_t op_code;
     int32_t dest_reg;
     int32_t src_reg[2];
+    uint8_t flags;
+    uint64_t mem_addr;
+    // hardware thread that fetched it
+    uint8_t thread;
     
     uint32_t id;
-    uint64_t dest_tag;
-    uint64_t src_tag[2];
+    uint32_t dest_tag;
+    uint32_t src_tag[2];
     bool src_ready[2];
     
     bool reserved;
@@ -66,6 +109,20 @@ typedef struct _proc_inst_t
     bool fired;
     bool executed;
     bool cdb_written;
+
+    // wakeup network: instructions waiting on this one's result, as a list
+    // of (handle << 1 | src) + 1 links threaded through next_consumer
+    uint32_t consumers;
+    uint32_t next_consumer[2];
+
+    // memory dependence: a load waits for the youngest older store to its
+    // address to execute. stores keep their waiting loads as handle + 1 links.
+    bool mem_ready;
+    uint32_t mem_waiters;
+    uint32_t next_mem_waiter;
+
+    // slot held in the scheduling queue
+    uint32_t sq_slot;
     
     uint64_t cycle_fetch_decode;
     uint64_t cycle_dispatch;
@@ -74,7 +131,128 @@ typedef struct _proc_inst_t
     uint64_t cycle_status_update;
 } proc_inst_t;
 
-typedef std::shared_ptr<proc_inst_t> proc_inst_ptr_t;
+// in-flight instructions are referred to by their slot in an inst_pool_t
+typedef uint32_t inst_handle_t;
+
+// the timing of one retired instruction, kept for the -b/-e dump
+struct inst_timing_t {
+    uint32_t id;
+    uint64_t cycle_fetch_decode;
+    uint64_t cycle_dispatch;
+    uint64_t cycle_schedule;
+    uint64_t cycle_execute;
+    uint64_t cycle_status_update;
+};
+
+// slab of in-flight instructions. retired entries are recycled, so memory
+// follows the size of the instruction window rather than the trace length.
+class inst_pool_t {
+public:
+    inst_handle_t alloc() {
+        inst_handle_t handle;
+        if (free_list.empty()) {
+            handle = slab.size();
+            slab.push_back(proc_inst_t());
+        } else {
+            handle = free_list.back();
+            free_list.pop_back();
+            slab[handle] = proc_inst_t();
+        }
+        return handle;
+    }
+    void release(inst_handle_t handle) { free_list.push_back(handle); }
+    void clear() { slab.clear(); free_list.clear(); }
+    void checkpoint(checkpoint_io_t &io) { io.vec(slab); io.vec(free_list); }
+
+    // only valid until the next alloc()
+    proc_inst_t& operator[](inst_handle_t handle) { return slab[handle]; }
+
+private:
+    std::vector<proc_inst_t> slab;
+    std::vector<inst_handle_t> free_list;
+};
+
+#define NO_INST ((inst_handle_t)-1)
+
+// fixed-capacity scheduling queue. entries stay in program order; removing
+// one only clears its slot, and the holes are squeezed out when the tail
+// reaches the end, at most once per dispatch.
+class sched_queue_t {
+public:
+    sched_queue_t() : tail(0), count(0) { }
+
+    void reset(uint32_t capacity) { slots.assign(capacity, NO_INST); tail = 0; count = 0; }
+
+    uint32_t size() const { return count; }
+    uint32_t capacity() const { return slots.size(); }
+    void checkpoint(checkpoint_io_t &io) { io.vec(slots); io.pod(tail); io.pod(count); }
+
+    void push(inst_pool_t &pool, inst_handle_t handle) {
+        if (tail == slots.size())
+            compact(pool);
+        pool[handle].sq_slot = tail;
+        slots[tail++] = handle;
+        count++;
+    }
+    void remove(inst_pool_t &pool, inst_handle_t handle) {
+        slots[pool[handle].sq_slot] = NO_INST;
+        count--;
+    }
+
+    // the entries in program order, with NO_INST in the holes
+    const inst_handle_t* begin() const { return slots.data(); }
+    const inst_handle_t* end() const { return slots.data() + tail; }
+
+private:
+    void compact(inst_pool_t &pool) {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < tail; i++) {
+            if (slots[i] != NO_INST) {
+                pool[slots[i]].sq_slot = n;
+                slots[n++] = slots[i];
+            }
+        }
+        std::fill(slots.begin() + n, slots.end(), NO_INST);
+        tail = n;
+    }
+
+    std::vector<inst_handle_t> slots;
+    uint32_t tail;
+    uint32_t count;
+};
+
+// reorder buffer: a ring of handles in program order. instructions enter
+// at dispatch and leave from the head as they commit.
+class rob_t {
+public:
+    rob_t() : head(0), count(0) { }
+
+    void reset(uint32_t capacity) { slots.assign(capacity, NO_INST); head = 0; count = 0; }
+
+    uint32_t size() const { return count; }
+    uint32_t capacity() const { return slots.size(); }
+    bool empty() const { return count == 0; }
+    void checkpoint(checkpoint_io_t &io) { io.vec(slots); io.pod(head); io.pod(count); }
+
+    void push(inst_handle_t handle) {
+        uint32_t tail = head + count;
+        if (tail >= slots.size())
+            tail -= slots.size();
+        slots[tail] = handle;
+        count++;
+    }
+    inst_handle_t front() const { return slots[head]; }
+    void pop() {
+        if (++head == slots.size())
+            head = 0;
+        count--;
+    }
+
+private:
+    std::vector<inst_handle_t> slots;
+    uint32_t head;
+    uint32_t count;
+};
 
 typedef struct _proc_stats_t
 {
@@ -84,13 +262,48 @@ typedef struct _proc_stats_t
     unsigned long max_disp_size;
     double sum_disp_size;
     float avg_disp_size;
+    // cycles in which a bounded dispatch queue held fetch back entirely,
+    // and cycles in which it let through fewer than F instructions
+    unsigned long fetch_stall_cycles;
+    unsigned long fetch_throttle_cycles;
+    // branch prediction: fetch waits for a mispredicted branch to resolve
+    unsigned long branches;
+    unsigned long mispredictions;
+    unsigned long mispredict_stall_cycles;
+    // loads held back by an older store to the same address
+    unsigned long mem_dep_loads;
+    // loads and stores reaching each cache level, and hitting in it
+    unsigned long cache_accesses[CACHE_LEVELS];
+    unsigned long cache_hits[CACHE_LEVELS];
+    // cycles in which a full reorder buffer held dispatch back
+    unsigned long rob_full_cycles;
+    // per hardware thread: instructions retired, and the cycle by which the
+    // thread had retired its last one
+    unsigned long thread_retired[PROC_MAX_THREADS];
+    unsigned long thread_cycles[PROC_MAX_THREADS];
 } proc_stats_t;
 
-// a cdb representation
+// the result buses, as parallel arrays so the register file write-back can
+// compare a vector of tags at once. tag 0 marks a free bus (ids start at 1).
 struct proc_cdb_t {
-    bool free;
-    uint32_t reg;
-    uint32_t tag;
+    uint32_t buses;
+    std::vector<uint32_t> tag;
+    std::vector<uint32_t> reg;
+    std::vector<inst_handle_t> producer;
+
+    void reset(uint32_t r) {
+        buses = r;
+        uint32_t padded = (r + CDB_LANES - 1) / CDB_LANES * CDB_LANES;
+        tag.assign(padded, 0);
+        reg.assign(padded, 0);
+        producer.assign(padded, 0);
+    }
+    bool free(uint32_t i) const { return tag[i] == 0; }
+    void checkpoint(checkpoint_io_t &io) { io.pod(buses); io.vec(tag); io.vec(reg); io.vec(producer); }
+    void clear() {
+        std::fill(tag.begin(), tag.end(), 0);
+        std::fill(reg.begin(), reg.end(), 0);
+    }
 };
 
 // our global state structure for the processor
@@ -105,23 +318,281 @@ struct proc_settings_t {
     uint64_t begin_dump;
     uint64_t end_dump;
     
+    // over all threads; instruction ids are handed out in this order
     uint64_t read_cnt;
     bool read_finished;
     bool finished;
 };
 
-struct register_info_t {
-    bool ready;
-    uint64_t tag;
+// the register file, as flat arrays indexed by register number
+struct register_file_t {
+    uint32_t tag[PROC_NUM_REGS];
+    bool ready[PROC_NUM_REGS];
+    inst_handle_t producer[PROC_NUM_REGS];
+};
+
+// where the fetch stage pulls decoded instructions from
+class trace_source_t {
+public:
+    virtual ~trace_source_t() { }
+
+    // returns true if an instruction was read successfully
+    virtual bool read_instruction(proc_inst_t* p_inst) = 0;
+
+    // passes over the next n instructions, returning how many there were
+    virtual uint64_t skip(uint64_t n) {
+        proc_inst_t inst;
+        uint64_t i = 0;
+        while (i < n && read_instruction(&inst))
+            i++;
+        return i;
+    }
+};
+
+// what each hardware thread keeps to itself. the scheduling queue, the
+// units, the result buses, the caches and the predictor are shared.
+struct hw_thread_t {
+    hw_thread_t(trace_source_t* source = NULL) : source(source) { }
+
+    trace_source_t* source;
+    std::deque<inst_handle_t> dispatching_queue;
+    register_file_t register_file;
+    rob_t rob;
+    // youngest store to each address that has not executed yet
+    std::unordered_map<uint64_t, inst_handle_t> last_store;
+
+    uint64_t fetched;
+    bool read_finished;
+    // fetch is stopped behind a mispredicted branch until it executes, then
+    // until fetch_resume_cycle
+    bool mispredict_pending;
+    uint64_t fetch_resume_cycle;
+    // fetched and not yet fired, for the ICOUNT fetch policy
+    uint32_t icount;
+};
+
+// which thread fetches in a cycle: the next one in turn that can, or the
+// one with the fewest instructions waiting to fire (ties in turn)
+enum fetch_policy_t {
+    FETCH_ROUND_ROBIN,
+    FETCH_ICOUNT
+};
+
+class timing_sink_t;
+struct proc_detail_stats_t;
+
+// optional machine features beyond setup's parameters. the defaults model
+// the original machine.
+struct proc_options_t {
+    proc_options_t() : dispatch_queue_limit(0), bp_kind(BP_NONE), bp_table_bits(12),
+                       bp_history_bits(12), mispredict_penalty(0), mem_dependences(false),
+                       rob_size(0), commit_width(0), generic_kernel(false),
+                       fetch_policy(FETCH_ROUND_ROBIN) {
+        for (int i = 0; i < NUM_FU_CLASSES; i++) {
+            fu_latency[i] = 1;
+            fu_pipelined[i] = true;
+        }
+    }
+
+    // dispatch queue capacity; fetch stalls while it is full. 0 is unbounded
+    uint64_t dispatch_queue_limit;
+
+    // cycles from execute to result per FU class, and whether a unit of the
+    // class can take a new instruction every cycle or only once it is done
+    uint32_t fu_latency[NUM_FU_CLASSES];
+    bool fu_pipelined[NUM_FU_CLASSES];
+
+    // fetch stops after a branch the predictor gets wrong, and restarts the
+    // cycle after it executes plus mispredict_penalty. BP_NONE never misses
+    bp_kind_t bp_kind;
+    uint32_t bp_table_bits;
+    uint32_t bp_history_bits;
+    uint32_t mispredict_penalty;
+
+    // loads wait for older stores to the same address to execute
+    bool mem_dependences;
+
+    // loads and stores take the FU latency plus what the caches add
+    cache_config_t cache;
+
+    // reorder buffer entries, 0 for none: instructions then retire as soon
+    // as they update state, out of order. commit_width caps in-order
+    // commits per cycle, 0 is unlimited
+    uint32_t rob_size;
+    uint32_t commit_width;
+
+    // run the machine shapes that have a specialized kernel on the generic one
+    bool generic_kernel;
+
+    // with more than one hardware thread. each thread's dispatch queue and
+    // reorder buffer get dispatch_queue_limit and rob_size entries
+    fetch_policy_t fetch_policy;
+};
+
+/*
+  the machine shape the stages' inner loops are bounded by: result buses,
+  units per FU class and fetch width. runtime_shape_t passes the values set
+  up at run time through; fixed_shape_t replaces them with constants, so a
+  kernel built on it has its loops over buses and units unrolled.
+*/
+struct runtime_shape_t {
+    static uint32_t buses(uint32_t r) { return r; }
+    static uint32_t fu(int, uint32_t k) { return k; }
+    static uint64_t fetch(uint64_t f) { return f; }
+};
+
+template <uint32_t R, uint32_t K0, uint32_t K1, uint32_t K2, uint64_t F>
+struct fixed_shape_t {
+    static uint32_t buses(uint32_t) { return R; }
+    static uint32_t fu(int i, uint32_t) { return i == 0 ? K0 : i == 1 ? K1 : K2; }
+    static uint64_t fetch(uint64_t) { return F; }
+};
+
+// one simulated processor. owns all of the pipeline state, so any number of
+// these can run side by side in the same process.
+class processor_t {
+public:
+    processor_t(trace_source_t* source) : threads(1, hw_thread_t(source)), timing_sink(NULL), stop_at(0), detail(NULL), kernel(NULL) { }
+    // a hardware thread per source, all fetching into the one back end
+    processor_t(const std::vector<trace_source_t*> &sources);
+
+    void set_options(const proc_options_t &o) { options = o; }
+
+    // where the -b/-e timing dump is streamed to (default: a text table on stdout)
+    void set_timing_sink(timing_sink_t* sink) { timing_sink = sink; }
+
+    // where the histograms and utilization counters go (default: not collected)
+    void set_detail_stats(proc_detail_stats_t* stats) { detail = stats; }
+
+    void setup(proc_stats_t *p_stats, uint64_t r, uint64_t k0, uint64_t k1, uint64_t k2, uint64_t f, uint64_t begin_dump, uint64_t end_dump);
+    void complete(proc_stats_t* p_stats);
+    void run(proc_stats_t* p_stats);
+
+    // run() returns at the end of the first cycle by which this many
+    // instructions have retired. 0 (the default) runs the trace to the end
+    void set_stop(uint64_t retired) { stop_at = retired; }
+    bool finished() const { return cpu.finished; }
+    // instructions read from the source since setup or reset_pipeline
+    uint64_t fetched() const { return cpu.read_cnt; }
+    uint32_t num_threads() const { return threads.size(); }
+    // whether run() goes through a kernel built for this machine shape
+    bool specialized_kernel() const;
+
+#ifdef PROCSIM_STAGE_TIMERS
+    // wall time spent in each stage by run(), both halves together
+    double stage_seconds(proc_stage_t stage) const { return std::chrono::duration<double>(stage_time[stage]).count(); }
+#endif
+
+    // the whole machine, statistics and trace position as a binary snapshot.
+    // restoring replaces setup(), and skips the source to where the
+    // snapshot was taken. false if the file could not be written or read
+    bool save_checkpoint(FILE* out, proc_stats_t* p_stats);
+    bool restore_checkpoint(FILE* in, proc_stats_t* p_stats);
+
+    // sampled simulation: empties the pipeline for a new detailed interval,
+    // keeping the predictor and caches, and reads n instructions only to
+    // train them. returns how many were read
+    void reset_pipeline(proc_stats_t* p_stats);
+    uint64_t warm(uint64_t n);
+    // trains the caches on the loads and stores that reset_pipeline is
+    // about to drop before they fired (the predictor saw every branch as it
+    // was fetched)
+    void warm_in_flight();
+
+    // our pipeline stages
+    void state_update(proc_stats_t* p_stats, const cycle_half_t &half);
+    void execute(proc_stats_t* p_stats, const cycle_half_t &half);
+    void schedule(proc_stats_t* p_stats, const cycle_half_t &half);
+    void dispatch(proc_stats_t* p_stats, const cycle_half_t &half);
+    void instr_fetch_and_decode(proc_stats_t* p_stats, const cycle_half_t &half);
+
+private:
+    int get_sqfree_slots();
+    void print_register_file();
+    void print_cdb();
+    void retire(inst_handle_t handle, proc_stats_t* p_stats);
+    uint64_t next_event_cycle(proc_stats_t* p_stats);
+    void fast_forward(proc_stats_t* p_stats);
+    void commit(proc_stats_t* p_stats);
+    uint32_t get_rob_free_slots(const hw_thread_t &thread);
+    bool rob_full();
+    uint64_t queued_instructions();
+    bool fetch_ready(const hw_thread_t &thread, uint64_t cycle);
+    bool mispredict_stalled(uint64_t cycle);
+    int select_fetch_thread(uint64_t cycle);
+    void resolve(inst_handle_t handle, uint64_t cycle);
+    uint32_t mem_latency(inst_handle_t handle, proc_stats_t* p_stats);
+    void wakeup(uint32_t bus);
+    uint64_t order_key(inst_handle_t handle) { return (uint64_t)instrs[handle].id << 32 | handle; }
+    void sort_by_id(std::vector<inst_handle_t> &handles);
+    void merge_executing(unsigned old_size);
+    bool checkpoint(checkpoint_io_t &io, proc_stats_t* p_stats);
+
+    // the cycle loop and the stages, for one machine shape. run() goes
+    // through kernel, picked by select_kernel() once the shape is known
+    typedef void (processor_t::*kernel_t)(proc_stats_t* p_stats);
+    void select_kernel();
+    template <class S> void run_cycles(proc_stats_t* p_stats);
+    template <class S> void execute_k(proc_stats_t* p_stats, const cycle_half_t &half);
+    template <class S> void schedule_k(proc_stats_t* p_stats, const cycle_half_t &half);
+    template <class S> void dispatch_k(proc_stats_t* p_stats, const cycle_half_t &half);
+    template <class S> void fetch_k(proc_stats_t* p_stats, const cycle_half_t &half);
+
+    std::vector<hw_thread_t> threads;
+    // where the next round of fetch starts looking
+    uint32_t fetch_next;
+    timing_sink_t* timing_sink;
+    uint64_t stop_at;
+    proc_detail_stats_t* detail;
+    kernel_t kernel;
+#ifdef PROCSIM_STAGE_TIMERS
+    std::chrono::steady_clock::duration stage_time[NUM_STAGES];
+#endif
+
+    proc_settings_t cpu;
+
+    inst_pool_t instrs;
+    // instructions retire out of order; dump rows wait here, by id - next_dump_id,
+    // until every earlier row in the window has been written
+    std::deque<inst_timing_t> dump_pending;
+    uint64_t next_dump_id;
+
+    proc_options_t options;
+    std::unique_ptr<branch_predictor_t> predictor;
+    cache_hierarchy_t caches;
+
+    sched_queue_t scheduling_queue;
+    uint32_t scheduling_queue_limit;
+
+    // event lists replacing scans of the scheduling queue. instructions
+    // dispatched last cycle, woken by the last CDB broadcast, marked to fire
+    // (per FU class, by id), fired but not yet executed (by id), executed
+    // last cycle, and marked complete this cycle.
+    std::vector<inst_handle_t> dispatched;
+    std::vector<inst_handle_t> woken;
+    std::priority_queue<uint64_t, std::vector<uint64_t>, std::greater<uint64_t> > ready[NUM_FU_CLASSES];
+    std::vector<inst_handle_t> executing;
+    // multi-cycle instructions still in their FU, by (completion cycle, id),
+    // and how many of each class there are
+    std::priority_queue<std::pair<uint64_t, uint64_t>, std::vector<std::pair<uint64_t, uint64_t> >,
+                        std::greater<std::pair<uint64_t, uint64_t> > > in_flight;
+    uint32_t in_flight_cnt[NUM_FU_CLASSES];
+    std::vector<inst_handle_t> completed;
+    std::vector<inst_handle_t> retiring;
+    // loads released by a store that executed this cycle
+    std::vector<inst_handle_t> mem_resolved;
+
+    proc_cdb_t cdb;
+    uint32_t fu_cnt[NUM_FU_CLASSES];
 };
 
-bool read_instruction(proc_inst_t* p_inst);
+// legacy entry points, driving a single default processor fed from set_trace_source()
+void set_trace_source(trace_source_t* source);
 
 void setup_proc(proc_stats_t *p_stats, uint64_t r, uint64_t k0, uint64_t k1, uint64_t k2, uint64_t f, uint64_t begin_dump, uint64_t end_dump);
 void complete_proc(proc_stats_t* p_stats);
 void run_proc(proc_stats_t* p_stats);
 
-// our pipeline stages
 void state_update(proc_stats_t* p_stats, const cycle_half_t &half);
 void execute(proc_stats_t* p_stats, const cycle_half_t &half);
 void schedule(proc_stats_t* p_stats, const cycle_half_t &half);
@@ -5,10 +5,22 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <inttypes.h>
+#include <chrono>
+#include <sys/resource.h>
 #include "procsim.hpp"
-
-FILE* inFile;
+#include "trace_reader.hpp"
+#include "trace_buffer.hpp"
+#include "sweep.hpp"
+#include "timing_sink.hpp"
+#include "sampling.hpp"
+#include "stats.hpp"
+#include "trace_prefetch.hpp"
+#include "server.hpp"
+#include "analyze.hpp"
+#include "shard.hpp"
+#include "result_cache.hpp"
 
 void print_help_and_exit(void) {
     printf("procsim [OPTIONS]\n");
@@ -17,103 +29,396 @@ void print_help_and_exit(void) {
     printf("  -l k2\t\tNumber of k2 FUs\n");   
     printf("  -f N\t\tNumber of instructions to fetch\n");
     printf("  -r R\t\tNumber of result buses\n");
-    printf("  -i traces/file.trace\n");
+    printf("  -i traces/file.trace\tgzip'd or raw trace, - for stdin\n");
+    printf("  -q N\t\tDispatch queue capacity, fetch stalls when full (default: unbounded)\n");
+    printf("  -L l0,l1,l2\tFU latency in cycles per class (default: 1,1,1)\n");
+    printf("  -U c[,c..]\tFU classes that are not pipelined (default: all pipelined)\n");
+    printf("  -B kind[:bits[:hist]]\tBranch predictor none|bimodal|gshare|tage, log2 table\n");
+    printf("    \t\tentries and global history bits (default: none, 12, 12)\n");
+    printf("  -P N\t\tExtra fetch cycles lost after a mispredict resolves (default: 0)\n");
+    printf("  -m\t\tLoads wait for older stores to the same address\n");
+    printf("  -C kb:ways:lat[,kb:ways:lat[,mem]]\tL1 and L2 caches (size in KB, associativity,\n");
+    printf("    \t\thit latency) and miss latency added to loads and stores (default: none)\n");
+    printf("  -R N\t\tReorder buffer entries, commit in order (default: none)\n");
+    printf("  -c N\t\tCommits per cycle with -R (default: unlimited)\n");
+    printf("  -x N:file\tStop once N instructions have retired and save a snapshot to file\n");
+    printf("  -X file\tResume from a snapshot of a run of the same trace; the machine\n");
+    printf("    \t\tsettings are the snapshot's\n");
+    printf("  -S P:U[:W]\tSampled simulation: every P instructions, simulate W in detail to\n");
+    printf("    \t\twarm up and measure the next U; train only the predictor and caches\n");
+    printf("    \t\tin between. IPC is extrapolated with a 95%% confidence interval\n");
+    printf("  -H N[:W[:T]]\tSplit the trace into N shards simulated side by side, each warming\n");
+    printf("    \t\tup in detail on the W instructions before it (default: 10000) after\n");
+    printf("    \t\ttraining only the predictor and caches on T more (default: 1000000),\n");
+    printf("    \t\tand add up their cycles. the seams are estimated to be off by the\n");
+    printf("    \t\tcycles the shards disagree by on the overlap. past the first shard\n");
+    printf("    \t\tthe dump's FETCH and DISP are 0 and the dispatch queue figures are\n");
+    printf("    \t\tonly estimates\n");
+    printf("  -E\t\tWith -H, also simulate serially and report the real difference\n");
+    printf("  -K dir\t\tKeep results in dir, keyed by the trace's contents, the machine\n");
+    printf("    \t\tsettings and the simulator version, and reuse them instead of\n");
+    printf("    \t\tsimulating again. for sweeps, server jobs and whole-trace runs\n");
+    printf("    \t\twithout a timing dump, -x/-X, -S, -H, -T or -J\n");
+    printf("  -J file\tWrite queue occupancy histograms, FU and CDB utilization, fire\n");
+    printf("    \t\tstall reasons and latency distributions to file as JSON\n");
+    printf("  -p\t\tReport the simulator's own speed and peak memory\n");
+    printf("  -T rr|icount\tSMT: every -i trace is a hardware thread with its own dispatch\n");
+    printf("    \t\tqueue, register file and ROB, sharing the scheduling queue, FUs and\n");
+    printf("    \t\tresult buses. one thread fetches per cycle, in turn (rr) or the one\n");
+    printf("    \t\twith the fewest instructions waiting to fire (icount)\n");
+    printf("  -D\t\tDecode the trace on the simulation thread (default: on a thread of\n");
+    printf("    \t\tits own when there is more than one core)\n");
+    printf("  -G\t\tRun on the generic kernel even where one is specialized for the\n");
+    printf("    \t\tmachine shape (the results are the same)\n");
+    printf("  -b N\t\tFirst instruction of the timing dump\n");
+    printf("  -e N\t\tLast instruction of the timing dump\n");
+    printf("  -d text|csv|bin\tTiming dump format (default: text)\n");
+    printf("  -w file\tWrite the timing dump to file instead of stdout\n");
+    printf("\n");
+    printf("  -s\t\tSweep mode. -r -f -j -k -l take lists such as 1,2,4 or\n");
+    printf("    \t\tlo:hi[:step] and -i may be repeated; each trace is decoded\n");
+    printf("    \t\tonce and every point is simulated (implied by any list)\n");
+    printf("  -t N\t\tSweep, shard or server worker threads (default: all cores)\n");
+    printf("  -o csv|json\tSweep output format (default: csv)\n");
+    printf("\n");
+    printf("  -Z -|socket\tServe simulation jobs from standard input, or a Unix socket at\n");
+    printf("    \t\tthe given path, one per line: trace=PATH [r= k0= k1= k2= f=]\n");
+    printf("    \t\t[begin= end=] [id=]. each is answered with a line of JSON; decoded\n");
+    printf("    \t\ttraces stay in memory between jobs. the other options apply to all\n");
+    printf("\n");
+    printf("  --analyze, -A\tReport the trace's register dataflow critical path and the IPC\n");
+    printf("    \t\tit allows with unlimited FUs and buses (with -L latencies), with and\n");
+    printf("    \t\twithout the -f fetch width, its dependency distances and op mix\n");
     printf("  -h\t\tThis helpful output\n");
     exit(0);
 }
 
-//
-// read_instruction
-//
-//  returns true if an instruction was read successfully
-//
-bool read_instruction(proc_inst_t* p_inst){
-    if(inFile == NULL){
+// with sharded set, the front-end figures are marked as estimates
+void print_statistics(proc_stats_t* p_stats, const proc_options_t &options, bool sharded = false);
+void print_sampled_statistics(const sample_result_t &result);
+void print_thread_statistics(proc_stats_t* p_stats, const std::vector<std::string> &tr_filenames);
+void print_analysis(const analysis_t &analysis, uint64_t f);
+void print_sharded_statistics(const shard_result_t &result, bool check_serial);
+void print_simulator_speed(const processor_t &proc, uint64_t instructions, uint64_t cycles, double seconds);
+
+static bool open_trace(trace_reader_t* reader, const std::string &tr_filename, FILE* log) {
+    if (!reader->open(tr_filename))
         return false;
-    }
+    fprintf(log, "Opened %s trace file: %s \n", reader->is_compressed() ? "gzip" : "raw", tr_filename.c_str());
+    return true;
+}
 
-    Trace_Rec tr_entry;    
+// one trace opened for simulation, and whatever its source reads it through
+struct trace_input_t {
+    trace_reader_t reader;
+    trace_buffer_t buffer;
+    std::unique_ptr<buffer_trace_source_t> buffer_source;
+    std::unique_ptr<prefetch_trace_source_t> prefetch;
+    trace_source_t* source;
+};
 
-    if (p_inst == NULL){
-        fprintf(stderr, "Fetch requires a valid pointer to populate\n");
+// compact ctrace files are mapped and replayed in place, anything else
+// streamed, adding what it reads to digest if one is given
+static bool open_input(const std::string &tr_filename, bool inline_decode, trace_input_t* in,
+                       trace_digest_t* digest = NULL) {
+    in->source = &in->reader;
+    in->reader.set_digest(digest);
+    if (is_ctrace_file(tr_filename)) {
+        if (!in->buffer.map_file(tr_filename))
+            return false;
+        printf("Mapped ctrace file: %s \n", tr_filename.c_str());
+        in->buffer_source.reset(new buffer_trace_source_t(&in->buffer));
+        in->source = in->buffer_source.get();
+    } else if (!open_trace(&in->reader, tr_filename, stdout)) {
         return false;
+    } else if (!inline_decode && std::thread::hardware_concurrency() > 1) {
+        // and a streamed trace is inflated and decoded ahead on another core
+        in->prefetch.reset(new prefetch_trace_source_t(&in->reader));
+        in->source = in->prefetch.get();
     }
+    return true;
+}
 
-    uint8_t bytes_read = 0;
-    bytes_read = fread(&tr_entry, 1, sizeof(Trace_Rec), inFile);
-    
-    // check for end of trace
-    if( bytes_read < sizeof(Trace_Rec)) {
+// the whole trace decoded into memory, reported as open_input does
+static bool load_input(const std::string &tr_filename, trace_buffer_t* buffer) {
+    buffer->name = tr_filename;
+    if (is_ctrace_file(tr_filename)) {
+        if (!buffer->map_file(tr_filename))
+            return false;
+        printf("Mapped ctrace file: %s \n", tr_filename.c_str());
+        return true;
+    }
+    trace_reader_t reader;
+    if (!open_trace(&reader, tr_filename, stdout))
+        return false;
+    if (!load_trace_buffer(&reader, buffer)) {
+        fprintf(stderr, "Trace %s has a register the simulator cannot hold\n", tr_filename.c_str());
         return false;
     }
+    return true;
+}
 
-    p_inst->instruction_address = tr_entry.inst_addr;
-
-    if(tr_entry.op_type == OP_ALU){
-        p_inst->op_code = 0;
-    }else if(tr_entry.op_type == OP_LD || tr_entry.op_type == OP_ST){
-        p_inst->op_code = 1;
-    }else if(tr_entry.op_type == OP_CBR){
-        p_inst->op_code = 2;
-    }else if(tr_entry.op_type == OP_OTHER){
-        p_inst->op_code = 0;
+static void parse_param_or_exit(char opt, const char* spec, std::vector<uint64_t>* values) {
+    values->clear();
+    if (!parse_param_list(spec, values)) {
+        fprintf(stderr, "Invalid value list for -%c: %s\n", opt, spec);
+        exit(1);
     }
+    for (size_t i = 0; i < values->size(); i++) {
+        if ((*values)[i] > SWEEP_MAX_PARAM) {
+            fprintf(stderr, "-%c values must be at most %d\n", opt, SWEEP_MAX_PARAM);
+            exit(1);
+        }
+    }
+}
 
-    if(tr_entry.dest_needed == 1){
-        p_inst->dest_reg = tr_entry.dest;
-    }else{
-        p_inst->dest_reg = (-1);
+// -r, -f, -j, -k and -l, which are caught here rather than by a sweep
+// worker that can never dispatch
+static void parse_machine_param_or_exit(char opt, const char* spec, std::vector<uint64_t>* values) {
+    parse_param_or_exit(opt, spec, values);
+    char name[32];
+    snprintf(name, sizeof(name), "-%c values", opt);
+    std::string error;
+    for (size_t i = 0; i < values->size(); i++) {
+        if (!check_machine_param(name, (*values)[i], &error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            exit(1);
+        }
     }
+}
 
-    if(tr_entry.src1_needed == 1){
-        p_inst->src_reg[0] = tr_entry.src1_reg;
-    }else{
-        p_inst->src_reg[0] = (-1);
-    }        
+// kb:ways:latency[,kb:ways:latency[,mem_latency]]
+static bool parse_cache_config(const char* spec, cache_config_t* cache) {
+    *cache = cache_config_t();
+    const char* p = spec;
+    for (int i = 0; i <= CACHE_LEVELS && *p; i++) {
+        unsigned long kb;
+        unsigned ways, latency;
+        int n;
+        if (i < CACHE_LEVELS && sscanf(p, "%lu:%u:%u%n", &kb, &ways, &latency, &n) == 3) {
+            cache->level[i].size = (uint64_t)kb * 1024;
+            cache->level[i].ways = ways;
+            cache->level[i].latency = latency;
+        } else if (i > 0 && sscanf(p, "%u%n", &latency, &n) == 1 && (p[n] == '\0')) {
+            cache->mem_latency = latency;
+        } else {
+            return false;
+        }
+        p += n;
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return false;
+    }
+    return *p == '\0' && cache->enabled() && valid_cache_config(*cache);
+}
 
-    if(tr_entry.src2_needed == 1){
-        p_inst->src_reg[1] = tr_entry.src2_reg;
-    }else{
-        p_inst->src_reg[1] = (-1);
-    }    
+// decodes every trace once and simulates the whole grid on all cores
+static int sweep_main(sweep_config_t &config, const std::vector<std::string> &tr_filenames) {
+    std::vector<trace_buffer_t> buffers(tr_filenames.size());
+    for (size_t i = 0; i < tr_filenames.size(); i++) {
+        if (!open_trace_buffer(tr_filenames[i], &buffers[i]))
+            return 1;
+        config.traces.push_back(&buffers[i]);
+    }
 
-    return true;
+    run_sweep(config, stdout);
+    return 0;
 }
 
-void print_statistics(proc_stats_t* p_stats);
-
 int main(int argc, char* argv[]) {
     int opt;
-    uint64_t f = DEFAULT_F;
-    uint64_t k0 = DEFAULT_K0;
-    uint64_t k1 = DEFAULT_K1;
-    uint64_t k2 = DEFAULT_K2;
-    uint64_t r = DEFAULT_R;
+    sweep_config_t config;
+    config.threads = 0;
+    config.format = SWEEP_CSV;
+    config.results = NULL;
+    bool sweep = false;
+    const char* results_dir = NULL;
 
-    uint64_t begin_dump; 
-    uint64_t end_dump; 
+    uint64_t checkpoint_at = 0;
+    const char* checkpoint_out = NULL;
+    const char* checkpoint_in = NULL;
+    sample_config_t sampling = sample_config_t();
+    shard_config_t sharding = shard_config_t();
+    sharding.warmup = 10000;
+    sharding.train = 1000000;
+    bool report_speed = false;
+    bool inline_decode = false;
+    bool smt = false;
+    const char* serve = NULL;
+    bool analyze = false;
+    const char* json_filename = NULL;
 
-    inFile = NULL;
+    const char* dump_format = "text";
+    const char* dump_filename = NULL;
+    uint64_t begin_dump = 0;
+    uint64_t end_dump = 0;
 
     /* Read arguments */ 
-    char tr_filename[256];    
-    char cmd_string[256];    
-    while(-1 != (opt = getopt(argc, argv, "r:f:j:k:l:b:e:i:h"))) {
+    std::vector<std::string> tr_filenames;
+    std::vector<uint64_t> values;
+    static const struct option long_options[] = {
+        {"analyze", no_argument, NULL, 'A'},
+        {NULL, 0, NULL, 0}
+    };
+    while(-1 != (opt = getopt_long(argc, argv, "r:f:j:k:l:q:L:U:B:P:mC:R:c:x:X:S:H:EJ:K:pGDT:Z:Ab:e:d:w:i:st:o:h", long_options, NULL))) {
         switch(opt) {
         case 'r':
-            r = atoi(optarg);
+            parse_machine_param_or_exit(opt, optarg, &config.r);
             break;
         case 'f':
-            f = atoi(optarg);
+            parse_machine_param_or_exit(opt, optarg, &config.f);
             break;            
         case 'j':
-            k0 = atoi(optarg);
+            parse_machine_param_or_exit(opt, optarg, &config.k0);
             break;
         case 'k':
-            k1 = atoi(optarg);
+            parse_machine_param_or_exit(opt, optarg, &config.k1);
             break;
         case 'l':
-            k2 = atoi(optarg);
+            parse_machine_param_or_exit(opt, optarg, &config.k2);
+            break;
+        case 'q':
+            config.options.dispatch_queue_limit = atoi(optarg);
+            break;
+        case 'L':
+            values.clear();
+            parse_param_or_exit(opt, optarg, &values);
+            if (values.size() != NUM_FU_CLASSES) {
+                fprintf(stderr, "-L takes one latency per FU class: l0,l1,l2\n");
+                return 1;
+            }
+            for (int i = 0; i < NUM_FU_CLASSES; i++) {
+                if (values[i] < 1) {
+                    fprintf(stderr, "FU latencies must be at least 1\n");
+                    return 1;
+                }
+                config.options.fu_latency[i] = values[i];
+            }
+            break;
+        case 'U':
+            values.clear();
+            parse_param_or_exit(opt, optarg, &values);
+            for (size_t i = 0; i < values.size(); i++) {
+                if (values[i] >= NUM_FU_CLASSES) {
+                    fprintf(stderr, "No FU class %" PRIu64 "\n", values[i]);
+                    return 1;
+                }
+                config.options.fu_pipelined[values[i]] = false;
+            }
+            break;
+        case 'B': {
+            // kind[:table_bits[:history_bits]]
+            std::string spec(optarg);
+            size_t colon = spec.find(':');
+            if (!parse_bp_kind(spec.substr(0, colon).c_str(), &config.options.bp_kind)) {
+                fprintf(stderr, "Unknown branch predictor %s\n", optarg);
+                return 1;
+            }
+            if (colon != std::string::npos) {
+                values.clear();
+                std::string sizes = spec.substr(colon + 1);
+                std::replace(sizes.begin(), sizes.end(), ':', ',');
+                parse_param_or_exit(opt, sizes.c_str(), &values);
+                if (values.size() > 2 || values[0] < 1 || values[0] > 28) {
+                    fprintf(stderr, "-B takes kind[:table_bits[:history_bits]], table_bits 1..28\n");
+                    return 1;
+                }
+                config.options.bp_table_bits = values[0];
+                if (values.size() > 1)
+                    config.options.bp_history_bits = values[1];
+            }
+            break;
+        }
+        case 'P':
+            config.options.mispredict_penalty = atoi(optarg);
+            break;
+        case 'm':
+            config.options.mem_dependences = true;
+            break;
+        case 'C':
+            if (!parse_cache_config(optarg, &config.options.cache)) {
+                fprintf(stderr, "Bad -C %s: want kb:ways:latency[,kb:ways:latency[,mem_latency]] "
+                        "with a power-of-two number of 64-byte sets\n", optarg);
+                return 1;
+            }
+            break;
+        case 'R':
+            config.options.rob_size = atoi(optarg);
+            break;
+        case 'c':
+            config.options.commit_width = atoi(optarg);
+            break;
+        case 'x': {
+            char* colon;
+            checkpoint_at = strtoull(optarg, &colon, 10);
+            if (*colon != ':' || colon[1] == '\0' || checkpoint_at == 0) {
+                fprintf(stderr, "-x takes N:file\n");
+                return 1;
+            }
+            checkpoint_out = colon + 1;
+            break;
+        }
+        case 'X':
+            checkpoint_in = optarg;
+            break;
+        case 'S': {
+            unsigned long period, interval, warmup = 0;
+            int n = sscanf(optarg, "%lu:%lu:%lu", &period, &interval, &warmup);
+            if (n < 2 || interval == 0 || period < warmup + interval) {
+                fprintf(stderr, "-S takes period:interval[:warmup], with warmup + interval <= period\n");
+                return 1;
+            }
+            sampling.period = period;
+            sampling.interval = interval;
+            sampling.warmup = warmup;
+            break;
+        }
+        case 'H': {
+            unsigned long shards, warmup = sharding.warmup, train = sharding.train;
+            if (sscanf(optarg, "%lu:%lu:%lu", &shards, &warmup, &train) < 1 || shards == 0) {
+                fprintf(stderr, "-H takes shards[:warmup[:train]], at least one shard\n");
+                return 1;
+            }
+            sharding.shards = shards;
+            sharding.warmup = warmup;
+            sharding.train = train;
+            break;
+        }
+        case 'E':
+            sharding.check_serial = true;
+            break;
+        case 'J':
+            json_filename = optarg;
+            break;
+        case 'K':
+            results_dir = optarg;
+            break;
+        case 'p':
+            report_speed = true;
+            break;
+        case 'G':
+            config.options.generic_kernel = true;
+            break;
+        case 'D':
+            inline_decode = true;
+            break;
+        case 'Z':
+            serve = optarg;
+            break;
+        case 'A':
+            analyze = true;
+            break;
+        case 'T':
+            smt = true;
+            if (strcmp(optarg, "rr") == 0) {
+                config.options.fetch_policy = FETCH_ROUND_ROBIN;
+            } else if (strcmp(optarg, "icount") == 0) {
+                config.options.fetch_policy = FETCH_ICOUNT;
+            } else {
+                fprintf(stderr, "Unknown fetch policy: %s\n", optarg);
+                exit(1);
+            }
             break;
         case 'b':
             begin_dump = atoi(optarg);
@@ -121,8 +426,29 @@ int main(int argc, char* argv[]) {
         case 'e':
             end_dump = atoi(optarg);
             break;    
+        case 'd':
+            dump_format = optarg;
+            break;
+        case 'w':
+            dump_filename = optarg;
+            break;
         case 'i':
-            strcpy(tr_filename, optarg);
+            tr_filenames.push_back(optarg);
+            break;
+        case 's':
+            sweep = true;
+            break;
+        case 't':
+            config.threads = atoi(optarg);
+            break;
+        case 'o':
+            if (strcmp(optarg, "csv") == 0) {
+                config.format = SWEEP_CSV;
+            } else if (strcmp(optarg, "json") == 0) {
+                config.format = SWEEP_JSON;
+            } else {
+                print_help_and_exit();
+            }
             break;
         case 'h':
             /* Fall through */
@@ -132,13 +458,117 @@ int main(int argc, char* argv[]) {
         }
     }
 
-    sprintf(cmd_string,"gunzip -c %s", tr_filename);    
-    if ((inFile = popen(cmd_string, "r")) == NULL){
-        printf("Command string is %s\n", cmd_string);
-        printf("Unable to open the trace file with gzip option \n");
-    } else {
-        printf("Opened file with command: %s \n", cmd_string);
-    } 
+    if (config.r.empty()) config.r.push_back(DEFAULT_R);
+    if (config.k0.empty()) config.k0.push_back(DEFAULT_K0);
+    if (config.k1.empty()) config.k1.push_back(DEFAULT_K1);
+    if (config.k2.empty()) config.k2.push_back(DEFAULT_K2);
+    if (config.f.empty()) config.f.push_back(DEFAULT_F);
+
+    result_cache_t results;
+    if (results_dir != NULL) {
+        if (!results.open(results_dir))
+            return 1;
+        config.results = &results;
+    }
+
+    if (serve != NULL) {
+        server_config_t server;
+        server.endpoint = serve;
+        server.threads = config.threads;
+        server.options = config.options;
+        server.results = config.results;
+        return run_server(server);
+    }
+
+    if (analyze && (sweep || smt || tr_filenames.size() != 1 || config.f.size() > 1)) {
+        fprintf(stderr, "--analyze takes one trace and one fetch width\n");
+        return 1;
+    }
+
+    if (smt && (sweep || config.r.size() > 1 || config.k0.size() > 1 || config.k1.size() > 1
+                || config.k2.size() > 1 || config.f.size() > 1)) {
+        fprintf(stderr, "SMT (-T) simulates a single machine\n");
+        return 1;
+    }
+    if (smt && (tr_filenames.size() > PROC_MAX_THREADS || sampling.period > 0)) {
+        fprintf(stderr, "SMT (-T) takes at most %d traces and no sampling (-S)\n", PROC_MAX_THREADS);
+        return 1;
+    }
+
+    if (sharding.shards > 0 && (smt || sampling.period > 0 || checkpoint_in != NULL || checkpoint_out != NULL
+                                || json_filename != NULL)) {
+        fprintf(stderr, "Sharding (-H) does not combine with -T, -S, -x, -X or -J\n");
+        return 1;
+    }
+
+    // more than one point in the grid implies a sweep
+    if ((!smt && tr_filenames.size() > 1) || config.r.size() > 1 || config.k0.size() > 1 || config.k1.size() > 1
+        || config.k2.size() > 1 || config.f.size() > 1)
+        sweep = true;
+
+    if (sweep)
+        return sweep_main(config, tr_filenames);
+
+    uint64_t r = config.r[0];
+    uint64_t k0 = config.k0[0];
+    uint64_t k1 = config.k1[0];
+    uint64_t k2 = config.k2[0];
+    uint64_t f = config.f[0];
+
+    // the analyzer and the simulator both divide the trace up by these
+    std::string error;
+    if (!check_machine_param("R", r, &error) || !check_machine_param("k0", k0, &error)
+        || !check_machine_param("k1", k1, &error) || !check_machine_param("k2", k2, &error)
+        || !check_machine_param("F", f, &error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    if (tr_filenames.empty()) {
+        fprintf(stderr, "No trace file given (-i)\n");
+        print_help_and_exit();
+    }
+
+    // with SMT every trace is a hardware thread of its own
+    std::vector<std::unique_ptr<trace_input_t> > inputs;
+    std::vector<trace_source_t*> sources;
+    // sharding replays the trace from memory, from several places at once
+    bool in_memory = sharding.shards > 0 && !analyze;
+    trace_buffer_t whole_trace;
+    if (in_memory && !load_input(tr_filenames[0], &whole_trace))
+        return 1;
+
+    // only plain runs of the whole trace are cached. a mapped ctrace file is
+    // hashed in place, and any other file's digest is kept in the cache once
+    // it has been worked out. without one, the trace is digested as it is
+    // simulated, and its result is stored but not looked up
+    bool cache_result = config.results != NULL && !smt && !analyze && sharding.shards == 0 && sampling.period == 0
+                        && checkpoint_in == NULL && checkpoint_out == NULL && json_filename == NULL && begin_dump == 0;
+    trace_digest_t digest;
+    std::string file_key;
+    bool digest_while_running = false;
+    if (cache_result && !is_ctrace_file(tr_filenames[0])) {
+        digest_while_running = tr_filenames[0] == "-" || !trace_file_key(tr_filenames[0], &file_key)
+                               || !results.lookup_digest(file_key, &digest);
+    }
+
+    size_t streamed = smt ? tr_filenames.size() : in_memory ? 0 : 1;
+    for (size_t i = 0; i < streamed; i++) {
+        inputs.push_back(std::unique_ptr<trace_input_t>(new trace_input_t()));
+        if (!open_input(tr_filenames[i], inline_decode, inputs.back().get(), digest_while_running ? &digest : NULL))
+            return 1;
+        sources.push_back(inputs.back()->source);
+    }
+
+    if (cache_result && inputs[0]->buffer_source)
+        digest = inputs[0]->buffer.digest();
+
+    if (analyze) {
+        analysis_t analysis;
+        analyze_trace(sources[0], f, config.options, &analysis);
+        print_analysis(analysis, f);
+        return 0;
+    }
 
     printf("Processor Settings\n");
     printf("R: %" PRIu64 "\n", r);
@@ -146,32 +576,271 @@ int main(int argc, char* argv[]) {
     printf("k1: %" PRIu64 "\n", k1);
     printf("k2: %" PRIu64 "\n", k2);
     printf("F: %"  PRIu64 "\n", f);
+    if (smt)
+        printf("Threads: %zu, fetch policy: %s\n", sources.size(),
+               config.options.fetch_policy == FETCH_ICOUNT ? "icount" : "rr");
+    for (int i = 0; i < NUM_FU_CLASSES; i++) {
+        if (config.options.fu_latency[i] != 1 || !config.options.fu_pipelined[i])
+            printf("k%d latency: %u%s\n", i, config.options.fu_latency[i],
+                   config.options.fu_pipelined[i] ? "" : " (not pipelined)");
+    }
+    if (config.options.bp_kind != BP_NONE)
+        printf("Branch predictor: %s, %u table bits, %u history bits, penalty %u\n",
+               bp_kind_name(config.options.bp_kind), config.options.bp_table_bits,
+               config.options.bp_history_bits, config.options.mispredict_penalty);
+    if (config.options.mem_dependences)
+        printf("Memory dependences: on\n");
+    for (int i = 0; i < CACHE_LEVELS; i++) {
+        const cache_level_config_t &c = config.options.cache.level[i];
+        if (c.size > 0)
+            printf("L%d: %" PRIu64 "KB, %u-way, %u cycles\n", i + 1, c.size / 1024, c.ways, c.latency);
+    }
+    if (config.options.cache.enabled())
+        printf("Memory: %u cycles\n", config.options.cache.mem_latency);
+    if (config.options.rob_size > 0) {
+        printf("ROB: %u", config.options.rob_size);
+        if (config.options.commit_width > 0)
+            printf(", commit width %u", config.options.commit_width);
+        printf("\n");
+    }
+    if (sharding.shards > 0)
+        printf("Shards: %u, %" PRIu64 " warm-up instructions each, %" PRIu64 " training\n",
+               sharding.shards, sharding.warmup, sharding.train);
     printf("\n");
 
     /* Setup statistics */
     proc_stats_t stats;
     memset(&stats, 0, sizeof(proc_stats_t));    
 
+    // stream the timing dump as instructions retire
+    FILE* dump_file = stdout;
+    if (dump_filename != NULL && (dump_file = fopen(dump_filename, "wb")) == NULL) {
+        fprintf(stderr, "Unable to create %s\n", dump_filename);
+        return 1;
+    }
+    timing_sink_t* sink = NULL;
+    if (strcmp(dump_format, "text") == 0) {
+        sink = new text_timing_sink_t(dump_file);
+    } else if (strcmp(dump_format, "csv") == 0) {
+        sink = new text_timing_sink_t(dump_file, true);
+    } else if (strcmp(dump_format, "bin") == 0) {
+        sink = new binary_timing_sink_t(dump_file);
+    } else {
+        print_help_and_exit();
+    }
+
+    if (sharding.shards > 0) {
+        sharding.r = r;
+        sharding.k0 = k0;
+        sharding.k1 = k1;
+        sharding.k2 = k2;
+        sharding.f = f;
+        sharding.options = config.options;
+        sharding.begin_dump = begin_dump;
+        sharding.end_dump = end_dump;
+        sharding.threads = config.threads;
+        shard_result_t result;
+        std::chrono::steady_clock::time_point run_start = std::chrono::steady_clock::now();
+        run_sharded(&whole_trace, sharding, sink, &stats, &result);
+        double run_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+        delete sink;
+        if (dump_file != stdout)
+            fclose(dump_file);
+        print_statistics(&stats, config.options, true);
+        print_sharded_statistics(result, sharding.check_serial);
+        if (report_speed)
+            printf("Simulator: %.3f s, %.0f instructions/s\n", run_seconds, stats.retired_instruction / run_seconds);
+        return 0;
+    }
+
+    if (cache_result && !digest_while_running) {
+        std::string key = result_key(digest, r, k0, k1, k2, f, config.options);
+        if (results.lookup(key, &stats)) {
+            fprintf(stderr, "Result cache hit: %s\n", results.path(key).c_str());
+            delete sink;
+            print_statistics(&stats, config.options);
+            if (report_speed)
+                printf("Simulator: cached result, nothing simulated\n");
+            return 0;
+        }
+    }
+
     /* Setup the processor */
-    setup_proc(&stats, r, k0, k1, k2, f, begin_dump, end_dump);
+    processor_t proc(sources);
+    proc.set_timing_sink(sink);
+    proc.set_options(config.options);
+    proc_detail_stats_t detail;
+    memset(&detail, 0, sizeof(detail));
+    if (json_filename != NULL)
+        proc.set_detail_stats(&detail);
+    // instruction ids restart with every sample, so there is no timing dump
+    if (sampling.period > 0)
+        begin_dump = end_dump = 0;
+    proc.setup(&stats, r, k0, k1, k2, f, begin_dump, end_dump);
+
+    if (checkpoint_in != NULL) {
+        FILE* in = fopen(checkpoint_in, "rb");
+        bool restored = in != NULL && proc.restore_checkpoint(in, &stats);
+        if (in != NULL)
+            fclose(in);
+        if (!restored) {
+            fprintf(stderr, "Unable to restore a snapshot from %s\n", checkpoint_in);
+            return 1;
+        }
+        printf("Restored %s at instruction %lu\n\n", checkpoint_in, stats.retired_instruction);
+    }
+
+    if (sampling.period > 0) {
+        sample_result_t result;
+        run_sampled(&proc, sampling, &result);
+        delete sink;
+        print_sampled_statistics(result);
+        return 0;
+    }
 
     /* Run the processor */
-    run_proc(&stats);
+    proc.set_stop(checkpoint_at);
+    std::chrono::steady_clock::time_point run_start = std::chrono::steady_clock::now();
+    uint64_t start_retired = stats.retired_instruction, start_cycle = stats.cycle_count;
+    proc.run(&stats);
+    double run_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+
+    if (checkpoint_out != NULL && !proc.finished()) {
+        FILE* out = fopen(checkpoint_out, "wb");
+        if (out == NULL || !proc.save_checkpoint(out, &stats) || fclose(out) != 0) {
+            fprintf(stderr, "Unable to write a snapshot to %s\n", checkpoint_out);
+            return 1;
+        }
+        printf("Saved %s at instruction %lu\n", checkpoint_out, stats.retired_instruction);
+    }
 
     /* Finalize stats */
-    complete_proc(&stats);
+    proc.complete(&stats);
+    if (cache_result && (!results.store(result_key(digest, r, k0, k1, k2, f, config.options), stats)
+                         || (digest_while_running && !file_key.empty() && !results.store_digest(file_key, digest))))
+        fprintf(stderr, "Unable to store the result in %s\n", results_dir);
+    delete sink;
+    if (dump_file != stdout)
+        fclose(dump_file);
 
-    print_statistics(&stats);
+    print_statistics(&stats, config.options);
+    if (smt)
+        print_thread_statistics(&stats, tr_filenames);
+    if (json_filename != NULL) {
+        FILE* json = fopen(json_filename, "w");
+        if (json == NULL) {
+            fprintf(stderr, "Unable to create %s\n", json_filename);
+            return 1;
+        }
+        write_stats_json(json, stats, detail);
+        fclose(json);
+    }
+    if (report_speed)
+        print_simulator_speed(proc, stats.retired_instruction - start_retired,
+                              stats.cycle_count - start_cycle, run_seconds);
 
     return 0;
 }
 
-void print_statistics(proc_stats_t* p_stats) {
+void print_statistics(proc_stats_t* p_stats, const proc_options_t &options, bool sharded) {
+    const char* estimate = sharded ? " (estimate)" : "";
     printf("Processor stats:\n");
     printf("Total instructions: %lu\n", p_stats->retired_instruction);    
     printf("Total run time (cycles): %lu\n", p_stats->cycle_count);
     printf("Avg inst retired per cycle: %f\n", p_stats->avg_inst_retired);
-    printf("Maximum Dispatch queue size: %lu\n", p_stats->max_disp_size);
-    printf("Avg Dispatch queue size: %f\n", p_stats->avg_disp_size);    
+    printf("Maximum Dispatch queue size%s: %lu\n", estimate, p_stats->max_disp_size);
+    printf("Avg Dispatch queue size%s: %f\n", estimate, p_stats->avg_disp_size);    
+    if (options.dispatch_queue_limit > 0) {
+        printf("Dispatch queue limit: %" PRIu64 "\n", options.dispatch_queue_limit);
+        printf("Fetch stall cycles (queue full)%s: %lu\n", estimate, p_stats->fetch_stall_cycles);
+        printf("Fetch throttled cycles (< F fetched)%s: %lu\n", estimate, p_stats->fetch_throttle_cycles);
+    }
+    if (options.bp_kind != BP_NONE) {
+        printf("Branches: %lu\n", p_stats->branches);
+        printf("Mispredictions: %lu (%f%%)\n", p_stats->mispredictions,
+               p_stats->branches ? 100.0 * p_stats->mispredictions / p_stats->branches : 0.0);
+        printf("Fetch stall cycles (mispredict): %lu\n", p_stats->mispredict_stall_cycles);
+    }
+    if (options.mem_dependences)
+        printf("Loads waiting on a store: %lu\n", p_stats->mem_dep_loads);
+    if (options.rob_size > 0)
+        printf("Dispatch stall cycles (ROB full): %lu\n", p_stats->rob_full_cycles);
+    for (int i = 0; i < CACHE_LEVELS; i++) {
+        if (options.cache.level[i].size > 0)
+            printf("L%d hit rate: %f (%lu of %lu)\n", i + 1,
+                   p_stats->cache_accesses[i] ? (double)p_stats->cache_hits[i] / p_stats->cache_accesses[i] : 0.0,
+                   p_stats->cache_hits[i], p_stats->cache_accesses[i]);
+    }
+}
+
+void print_thread_statistics(proc_stats_t* p_stats, const std::vector<std::string> &tr_filenames) {
+    for (size_t i = 0; i < tr_filenames.size(); i++) {
+        printf("Thread %zu (%s): %lu instructions in %lu cycles, IPC %f\n", i, tr_filenames[i].c_str(),
+               p_stats->thread_retired[i], p_stats->thread_cycles[i],
+               p_stats->thread_cycles[i] ? (double)p_stats->thread_retired[i] / p_stats->thread_cycles[i] : 0.0);
+    }
+    printf("Aggregate throughput (inst retired per cycle): %f\n", p_stats->avg_inst_retired);
+}
+
+void print_analysis(const analysis_t &a, uint64_t f) {
+    printf("Dataflow limit:\n");
+    printf("Total instructions: %" PRIu64 "\n", a.instructions);
+    for (int i = 0; i < NUM_FU_CLASSES; i++)
+        printf("k%d instructions: %" PRIu64 " (%f%%)\n", i, a.op_class[i],
+               a.instructions ? 100.0 * a.op_class[i] / a.instructions : 0.0);
+    printf("Branches: %" PRIu64 ", loads: %" PRIu64 ", stores: %" PRIu64 "\n", a.branches, a.loads, a.stores);
+    printf("Critical path (cycles): %" PRIu64 "\n", a.critical_path);
+    printf("Ideal inst retired per cycle: %f\n", a.critical_path ? (double)a.instructions / a.critical_path : 0.0);
+    printf("Critical path, fetching %" PRIu64 " per cycle (cycles): %" PRIu64 "\n", f, a.fetch_bound_path);
+    printf("Ideal inst retired per cycle, fetching %" PRIu64 " per cycle: %f\n", f,
+           a.fetch_bound_path ? (double)a.instructions / a.fetch_bound_path : 0.0);
+    printf("Source operands with no producer in the trace: %" PRIu64 "\n", a.no_producer);
+    printf("Dependency distance (instructions):\n");
+    for (int i = 1; i < 65; i++) {
+        if (a.dep_distance.count[i] > 0)
+            printf("  %" PRIu64 "-%" PRIu64 ": %" PRIu64 "\n", (uint64_t)1 << (i - 1), ((uint64_t)1 << i) - 1,
+                   a.dep_distance.count[i]);
+    }
 }
 
+void print_sharded_statistics(const shard_result_t &result, bool check_serial) {
+    printf("Seam error estimate (cycles): %" PRIu64 " (%f%%)\n", result.seam_cycles, 100 * result.error_estimate);
+    if (check_serial)
+        printf("Serial run time (cycles): %" PRIu64 ", sharded off by %f%%\n", result.serial_cycles,
+               100 * result.serial_error);
+}
+
+void print_sampled_statistics(const sample_result_t &result) {
+    printf("Processor stats (sampled):\n");
+    printf("Total instructions: %" PRIu64 "\n", result.instructions);
+    printf("Samples: %" PRIu64 "\n", result.samples);
+    printf("Instructions simulated in detail: %" PRIu64 "\n", result.detailed);
+    if (result.samples == 0) {
+        printf("No samples: the trace ended within the first warmup\n");
+        return;
+    }
+    double lo = result.cpi + result.cpi_half_width;
+    double hi = result.cpi - result.cpi_half_width;
+    printf("Estimated run time (cycles): %.0f\n", result.cpi * result.instructions);
+    printf("Estimated inst retired per cycle: %f\n", 1 / result.cpi);
+    if (hi > 0)
+        printf("95%% confidence interval: %f - %f\n", 1 / lo, 1 / hi);
+    else
+        printf("95%% confidence interval: %f - inf\n", 1 / lo);
+}
+
+// how fast the simulator itself ran, for `make bench`
+void print_simulator_speed(const processor_t &proc, uint64_t instructions, uint64_t cycles, double seconds) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Simulator: %.3f s, %.0f instructions/s, %.0f cycles/s, peak RSS %ld KB\n", seconds,
+           instructions / seconds, cycles / seconds, usage.ru_maxrss);
+    printf("  kernel: %s\n", proc.specialized_kernel() ? "specialized" : "generic");
+#ifdef PROCSIM_STAGE_TIMERS
+    static const char* const names[NUM_STAGES] = { "state_update", "execute", "schedule", "dispatch", "instr_fetch_and_decode" };
+    for (int i = 0; i < NUM_STAGES; i++) {
+        double t = proc.stage_seconds((proc_stage_t)i);
+        printf("  %-24s %.3f s (%.1f%%)\n", names[i], t, 100 * t / seconds);
+    }
+#endif
+}
@@ -0,0 +1,151 @@
+#include "result_cache.hpp"
+#include <stdlib.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
+
+bool result_cache_t::open(const std::string &dir) {
+    this->dir = dir;
+    if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Unable to create result cache %s: %s\n", dir.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Result cache %s is not a directory\n", dir.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::string result_cache_t::record_path(const std::string &key, const char* suffix) const {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < key.size(); i++)
+        h = (h ^ (uint8_t)key[i]) * 0x100000001b3ull;
+    char name[32];
+    snprintf(name, sizeof(name), "/%016" PRIx64 "%s", h, suffix);
+    return dir + name;
+}
+
+std::string result_cache_t::path(const std::string &key) const {
+    return record_path(key, ".res");
+}
+
+bool result_cache_t::read_record(const std::string &key, const char* suffix, void* data, uint32_t size) const {
+    FILE* in = fopen(record_path(key, suffix).c_str(), "rb");
+    if (in == NULL)
+        return false;
+
+    char magic[8];
+    uint32_t key_size = 0, data_size = 0;
+    std::string stored;
+    bool ok = fread(magic, 1, sizeof(magic), in) == sizeof(magic) && memcmp(magic, RESULT_CACHE_MAGIC, sizeof(magic)) == 0
+              && fread(&key_size, sizeof(key_size), 1, in) == 1 && key_size == key.size();
+    if (ok) {
+        stored.resize(key_size);
+        ok = fread(&stored[0], 1, key_size, in) == key_size && stored == key
+             && fread(&data_size, sizeof(data_size), 1, in) == 1 && data_size == size
+             && fread(data, size, 1, in) == 1;
+    }
+    fclose(in);
+    return ok;
+}
+
+bool result_cache_t::write_record(const std::string &key, const char* suffix, const void* data, uint32_t size) const {
+    // a name no other writer, in this process or another, is using
+    static std::atomic<uint64_t> serial(0);
+    std::string final_path = record_path(key, suffix);
+    char tmp_suffix[64];
+    snprintf(tmp_suffix, sizeof(tmp_suffix), ".%ld.%" PRIu64 ".tmp", (long)getpid(), serial++);
+    std::string tmp_path = final_path + tmp_suffix;
+
+    FILE* out = fopen(tmp_path.c_str(), "wb");
+    if (out == NULL)
+        return false;
+    uint32_t key_size = key.size();
+    bool ok = fwrite(RESULT_CACHE_MAGIC, 1, 8, out) == 8
+              && fwrite(&key_size, sizeof(key_size), 1, out) == 1
+              && fwrite(key.data(), 1, key.size(), out) == key.size()
+              && fwrite(&size, sizeof(size), 1, out) == 1
+              && fwrite(data, size, 1, out) == 1;
+    ok = fclose(out) == 0 && ok;
+    if (ok)
+        ok = rename(tmp_path.c_str(), final_path.c_str()) == 0;
+    if (!ok)
+        unlink(tmp_path.c_str());
+    return ok;
+}
+
+bool result_cache_t::lookup(const std::string &key, proc_stats_t* p_stats) const {
+    return read_record(key, ".res", p_stats, sizeof(proc_stats_t));
+}
+
+bool result_cache_t::store(const std::string &key, const proc_stats_t &stats) const {
+    return write_record(key, ".res", &stats, sizeof(proc_stats_t));
+}
+
+bool result_cache_t::lookup_digest(const std::string &file_key, trace_digest_t* digest) const {
+    return read_record(file_key, ".dig", digest, sizeof(trace_digest_t));
+}
+
+bool result_cache_t::store_digest(const std::string &file_key, const trace_digest_t &digest) const {
+    return write_record(file_key, ".dig", &digest, sizeof(trace_digest_t));
+}
+
+bool trace_file_key(const std::string &filename, std::string* key) {
+    char* full = realpath(filename.c_str(), NULL);
+    struct stat st;
+    bool ok = full != NULL && stat(full, &st) == 0 && S_ISREG(st.st_mode);
+    if (ok) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), " size=%" PRIu64 " mtime=%ld.%09ld", (uint64_t)st.st_size,
+                 (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+        *key = std::string("file=") + full + buf;
+    }
+    free(full);
+    return ok;
+}
+
+// settings that make no difference (predictor sizes with no predictor, and
+// so on) are left out, so that such runs share a result
+std::string result_key(const trace_digest_t &trace, uint64_t r, uint64_t k0, uint64_t k1, uint64_t k2, uint64_t f,
+                       const proc_options_t &options) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "model=%d trace=%016" PRIx64 ":%" PRIu64 " r=%" PRIu64 " k0=%" PRIu64 " k1=%" PRIu64
+             " k2=%" PRIu64 " f=%" PRIu64 " q=%" PRIu64, PROCSIM_MODEL_VERSION, trace.value(), trace.count(),
+             r, k0, k1, k2, f, options.dispatch_queue_limit);
+    std::string key = buf;
+    for (int i = 0; i < NUM_FU_CLASSES; i++) {
+        snprintf(buf, sizeof(buf), " l%d=%u%s", i, options.fu_latency[i], options.fu_pipelined[i] ? "" : "u");
+        key += buf;
+    }
+    if (options.bp_kind != BP_NONE) {
+        snprintf(buf, sizeof(buf), " bp=%s:%u:%u", bp_kind_name(options.bp_kind), options.bp_table_bits,
+                 options.mispredict_penalty);
+        key += buf;
+        // bimodal keeps no global history
+        if (options.bp_kind != BP_BIMODAL) {
+            snprintf(buf, sizeof(buf), ":%u", options.bp_history_bits);
+            key += buf;
+        }
+    }
+    if (options.mem_dependences)
+        key += " m";
+    if (options.cache.enabled()) {
+        for (int i = 0; i < CACHE_LEVELS; i++) {
+            const cache_level_config_t &c = options.cache.level[i];
+            snprintf(buf, sizeof(buf), " L%d=%" PRIu64 ":%u:%u", i + 1, c.size, c.ways, c.latency);
+            key += buf;
+        }
+        snprintf(buf, sizeof(buf), " mem=%u", options.cache.mem_latency);
+        key += buf;
+    }
+    if (options.rob_size > 0) {
+        snprintf(buf, sizeof(buf), " rob=%u:%u", options.rob_size, options.commit_width);
+        key += buf;
+    }
+    return key;
+}
@@ -0,0 +1,59 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include "trace_buffer.hpp"
+
+#define RESULT_CACHE_MAGIC "PSIMRES1"
+
+/*
+  finished simulations kept on disk, one small file per result, so repeat
+  sweeps and regression runs need not simulate again. a result is keyed by
+  the trace's digest, every setting that changes what is simulated and
+  PROCSIM_MODEL_VERSION; the file name is a hash of the key and the file
+  holds the key itself, so a collision is a miss.
+
+  the digests of trace files are kept the same way, keyed by the file's
+  path, size and modification time, so a trace that has been simulated
+  once is looked up without being read again.
+
+  records are written to a temporary file and renamed into place, so any
+  number of processes can share a directory: a reader sees a whole record
+  or none, and two writers of the same key write the same bytes. like
+  snapshots, records are raw proc_stats_t and only good for the build
+  layout that wrote them.
+*/
+class result_cache_t {
+public:
+    // creates the directory if it does not exist. says why on stderr on failure
+    bool open(const std::string &dir);
+
+    // true, with the statistics complete() left, if key has been stored
+    bool lookup(const std::string &key, proc_stats_t* p_stats) const;
+    // false if the record could not be written
+    bool store(const std::string &key, const proc_stats_t &stats) const;
+
+    std::string path(const std::string &key) const;
+
+    // the digest of a trace file, kept beside the results so that a file
+    // need not be read through just to look its results up. file_key says
+    // which file and how it looked; see trace_file_key
+    bool lookup_digest(const std::string &file_key, trace_digest_t* digest) const;
+    bool store_digest(const std::string &file_key, const trace_digest_t &digest) const;
+
+private:
+    std::string record_path(const std::string &key, const char* suffix) const;
+    bool read_record(const std::string &key, const char* suffix, void* data, uint32_t size) const;
+    bool write_record(const std::string &key, const char* suffix, const void* data, uint32_t size) const;
+
+    std::string dir;
+};
+
+// a trace file's absolute path, size and modification time, which a stored
+// digest is good for. false if the file cannot be looked at
+bool trace_file_key(const std::string &filename, std::string* key);
+
+// the key of one single-threaded run of the whole trace with this digest
+std::string result_key(const trace_digest_t &trace, uint64_t r, uint64_t k0, uint64_t k1, uint64_t k2, uint64_t f,
+                       const proc_options_t &options);
+
+#endif /* RESULT_CACHE_H */
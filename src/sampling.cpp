@@ -0,0 +1,54 @@
+#include "sampling.hpp"
+#include <math.h>
+#include <string.h>
+
+void run_sampled(processor_t* proc, const sample_config_t &config, sample_result_t* result) {
+    memset(result, 0, sizeof(*result));
+    double sum = 0, sum_sq = 0;
+
+    for (;;) {
+        proc_stats_t stats;
+        memset(&stats, 0, sizeof(stats));
+        proc->reset_pipeline(&stats);
+
+        // detailed warmup, then the measured interval. instructions still
+        // in flight at its end are dropped with the pipeline
+        if (config.warmup > 0) {
+            proc->set_stop(config.warmup);
+            proc->run(&stats);
+        }
+        uint64_t start_cycle = stats.cycle_count, start_retired = stats.retired_instruction;
+        proc->set_stop(config.warmup + config.interval);
+        proc->run(&stats);
+
+        if (stats.retired_instruction > start_retired) {
+            double cpi = (double)(stats.cycle_count - start_cycle) / (stats.retired_instruction - start_retired);
+            sum += cpi;
+            sum_sq += cpi * cpi;
+            result->samples++;
+        }
+        // instructions fetched but still in flight are dropped, not simulated
+        result->instructions += proc->fetched();
+        result->detailed += stats.retired_instruction;
+        if (proc->finished())
+            break;
+        proc->warm_in_flight();
+
+        // functional warming up to the next sample
+        uint64_t gap = config.period > proc->fetched() ? config.period - proc->fetched() : 0;
+        uint64_t skipped = proc->warm(gap);
+        result->instructions += skipped;
+        if (skipped < gap)
+            break;
+    }
+    proc->set_stop(0);
+
+    if (result->samples > 0) {
+        uint64_t n = result->samples;
+        result->cpi = sum / n;
+        if (n > 1) {
+            double variance = (sum_sq - sum * sum / n) / (n - 1);
+            result->cpi_half_width = 1.96 * sqrt(variance > 0 ? variance : 0) / sqrt((double)n);
+        }
+    }
+}
@@ -0,0 +1,29 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+#include "procsim.hpp"
+
+/*
+  SimPoint/SMARTS-style sampled simulation. every period instructions the
+  pipeline is emptied and simulated in detail for warmup + interval
+  instructions; only the interval is measured. the instructions in
+  between only train the branch predictor and caches.
+*/
+struct sample_config_t {
+    uint64_t period;
+    uint64_t interval;
+    uint64_t warmup;
+};
+
+struct sample_result_t {
+    uint64_t samples;
+    uint64_t instructions;      // in the whole trace
+    uint64_t detailed;          // simulated cycle by cycle
+    double cpi;                 // mean over the samples
+    double cpi_half_width;      // of its 95% confidence interval
+};
+
+// runs a processor that has been setup() over the rest of its trace
+void run_sampled(processor_t* proc, const sample_config_t &config, sample_result_t* result);
+
+#endif /* SAMPLING_H */
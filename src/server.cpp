@@ -0,0 +1,494 @@
+#include "server.hpp"
+#include "timing_sink.hpp"
+#include "sweep.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+
+// where a job's answer goes: standard output or one client's socket. the
+// socket is closed once its reader and every job it queued are done
+class connection_t {
+public:
+    connection_t(int in_fd, int out_fd, bool owned) : in_fd(in_fd), out_fd(out_fd), owned(owned) { }
+    ~connection_t() {
+        if (owned)
+            close(in_fd);
+    }
+
+    // one whole line at a time, so answers from different workers never interleave
+    void send(const std::string &line) {
+        std::lock_guard<std::mutex> guard(lock);
+        size_t done = 0;
+        while (done < line.size()) {
+            ssize_t n = write(out_fd, line.data() + done, line.size() - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            // the client went away; its remaining answers are dropped
+            if (n <= 0)
+                return;
+            done += n;
+        }
+    }
+
+    int in_fd;
+
+private:
+    int out_fd;
+    bool owned;
+    std::mutex lock;
+};
+
+// a decoded trace and the file it was decoded from
+struct cached_trace_t {
+    std::mutex lock;    // held while it is being (re)decoded
+    struct timespec mtime;
+    off_t size;
+    std::shared_ptr<const trace_buffer_t> buffer;
+};
+
+class trace_cache_t {
+public:
+    // the trace at path, decoding it if it is not resident or the file has
+    // changed. jobs still running on an older copy keep it alive. NULL, and
+    // why in *error, if it cannot be read
+    std::shared_ptr<const trace_buffer_t> get(const std::string &path, std::string* error);
+
+private:
+    std::mutex lock;
+    std::map<std::string, std::shared_ptr<cached_trace_t> > traces;
+};
+
+std::shared_ptr<const trace_buffer_t> trace_cache_t::get(const std::string &path, std::string* error) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        *error = std::string("cannot open trace: ") + strerror(errno);
+        return std::shared_ptr<const trace_buffer_t>();
+    }
+
+    std::shared_ptr<cached_trace_t> entry;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::shared_ptr<cached_trace_t> &slot = traces[path];
+        if (!slot)
+            slot.reset(new cached_trace_t());
+        entry = slot;
+    }
+
+    // other traces stay available while this one decodes
+    std::lock_guard<std::mutex> guard(entry->lock);
+    if (!entry->buffer || entry->size != st.st_size || entry->mtime.tv_sec != st.st_mtim.tv_sec
+        || entry->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+        std::shared_ptr<trace_buffer_t> buffer(new trace_buffer_t());
+        if (!open_trace_buffer(path, buffer.get())) {
+            *error = "cannot decode trace";
+            entry->buffer.reset();
+            return std::shared_ptr<const trace_buffer_t>();
+        }
+        entry->mtime = st.st_mtim;
+        entry->size = st.st_size;
+        entry->buffer = buffer;
+    }
+    return entry->buffer;
+}
+
+struct server_job_t {
+    std::shared_ptr<connection_t> conn;
+    std::string id;
+    std::string trace;
+    uint64_t r, k0, k1, k2, f;
+    uint64_t begin_dump, end_dump;
+};
+
+// jobs waiting for a worker
+class job_queue_t {
+public:
+    job_queue_t() : closed(false) { }
+
+    // false once the queue has been closed
+    bool push(const server_job_t &job) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (closed)
+            return false;
+        jobs.push_back(job);
+        ready.notify_one();
+        return true;
+    }
+    // waits for a job. false once the queue is closed and empty
+    bool pop(server_job_t* job) {
+        std::unique_lock<std::mutex> guard(lock);
+        while (jobs.empty() && !closed)
+            ready.wait(guard);
+        if (jobs.empty())
+            return false;
+        *job = jobs.front();
+        jobs.pop_front();
+        return true;
+    }
+    void close() {
+        std::lock_guard<std::mutex> guard(lock);
+        closed = true;
+        ready.notify_all();
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<server_job_t> jobs;
+    bool closed;
+};
+
+static std::string json_string(const std::string &s) {
+    std::string out = "\"";
+    for (size_t i = 0; i < s.size(); i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            out += esc;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+static std::string error_line(const std::string &id, const std::string &error) {
+    std::string line = "{";
+    if (!id.empty())
+        line += "\"id\": " + json_string(id) + ", ";
+    return line + "\"error\": " + json_string(error) + "}\n";
+}
+
+// the timing dump as a JSON array of [id, fetch, disp, sched, exec, state]
+class json_timing_sink_t : public timing_sink_t {
+public:
+    void begin() { rows = "["; }
+    void write(const inst_timing_t &t) {
+        char row[128];
+        snprintf(row, sizeof(row), "%s[%u, %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64 "]",
+                 rows.size() > 1 ? ", " : "", t.id, t.cycle_fetch_decode, t.cycle_dispatch,
+                 t.cycle_schedule, t.cycle_execute, t.cycle_status_update);
+        rows += row;
+    }
+    void end() { rows += "]"; }
+
+    std::string rows;
+};
+
+// the answer line to one job
+static std::string answer_job(const server_job_t &job, trace_cache_t* cache, const server_config_t &config) {
+    const proc_options_t &options = config.options;
+    std::string error;
+    std::shared_ptr<const trace_buffer_t> trace = cache->get(job.trace, &error);
+    if (!trace)
+        return error_line(job.id, error);
+
+    std::string key;
+    bool cached = false;
+    proc_stats_t stats;
+    json_timing_sink_t sink;
+    if (config.results != NULL && job.begin_dump == 0) {
+        key = result_key(trace->digest(), job.r, job.k0, job.k1, job.k2, job.f, options);
+        cached = config.results->lookup(key, &stats);
+    }
+    if (!cached) {
+        buffer_trace_source_t source(trace.get());
+        processor_t proc(&source);
+        proc.set_options(options);
+        proc.set_timing_sink(&sink);
+
+        memset(&stats, 0, sizeof(proc_stats_t));
+        proc.setup(&stats, job.r, job.k0, job.k1, job.k2, job.f, job.begin_dump, job.end_dump);
+        proc.run(&stats);
+        proc.complete(&stats);
+        if (!key.empty())
+            config.results->store(key, stats);
+    }
+
+    char buf[1024];
+    std::string line = "{";
+    if (!job.id.empty())
+        line += "\"id\": " + json_string(job.id) + ", ";
+    line += "\"trace\": " + json_string(job.trace);
+    snprintf(buf, sizeof(buf), ", \"r\": %" PRIu64 ", \"k0\": %" PRIu64 ", \"k1\": %" PRIu64 ", \"k2\": %" PRIu64
+             ", \"f\": %" PRIu64 ", \"instructions\": %lu, \"cycles\": %lu, \"ipc\": %f"
+             ", \"max_disp_size\": %lu, \"avg_disp_size\": %f, \"fetch_stall_cycles\": %lu"
+             ", \"fetch_throttle_cycles\": %lu, \"branches\": %lu, \"mispredictions\": %lu"
+             ", \"mispredict_stall_cycles\": %lu, \"mem_dep_loads\": %lu, \"rob_full_cycles\": %lu",
+             job.r, job.k0, job.k1, job.k2, job.f, stats.retired_instruction, stats.cycle_count,
+             stats.avg_inst_retired, stats.max_disp_size, stats.avg_disp_size, stats.fetch_stall_cycles,
+             stats.fetch_throttle_cycles, stats.branches, stats.mispredictions, stats.mispredict_stall_cycles,
+             stats.mem_dep_loads, stats.rob_full_cycles);
+    line += buf;
+    if (options.cache.enabled()) {
+        line += ", \"cache_hits\": [";
+        for (int i = 0; i < CACHE_LEVELS; i++) {
+            snprintf(buf, sizeof(buf), "%s%lu", i ? ", " : "", stats.cache_hits[i]);
+            line += buf;
+        }
+        line += "], \"cache_accesses\": [";
+        for (int i = 0; i < CACHE_LEVELS; i++) {
+            snprintf(buf, sizeof(buf), "%s%lu", i ? ", " : "", stats.cache_accesses[i]);
+            line += buf;
+        }
+        line += "]";
+    }
+    if (job.begin_dump > 0)
+        line += ", \"timing\": " + sink.rows;
+    return line + "}\n";
+}
+
+static void run_job(const server_job_t &job, trace_cache_t* cache, const server_config_t &config) {
+    // one job that cannot be simulated (out of memory, say) fails alone,
+    // not the server and every other job queued on it
+    std::string line;
+    try {
+        line = answer_job(job, cache, config);
+    } catch (const std::exception &e) {
+        line = error_line(job.id, std::string("job failed: ") + e.what());
+    }
+    job.conn->send(line);
+}
+
+static void server_worker(job_queue_t* queue, trace_cache_t* cache, const server_config_t* config) {
+    server_job_t job;
+    while (queue->pop(&job)) {
+        run_job(job, cache, *config);
+        // let go of the connection as soon as this job is answered
+        job.conn.reset();
+    }
+}
+
+// fills job from one request line. false, and why in *error, if it is malformed
+static bool parse_job(const std::string &line, server_job_t* job, std::string* error) {
+    job->r = DEFAULT_R;
+    job->k0 = DEFAULT_K0;
+    job->k1 = DEFAULT_K1;
+    job->k2 = DEFAULT_K2;
+    job->f = DEFAULT_F;
+    job->begin_dump = job->end_dump = 0;
+
+    size_t pos = 0;
+    while (pos < line.size()) {
+        size_t start = line.find_first_not_of(" \t\r", pos);
+        if (start == std::string::npos)
+            break;
+        size_t end = line.find_first_of(" \t\r", start);
+        if (end == std::string::npos)
+            end = line.size();
+        pos = end;
+
+        std::string token = line.substr(start, end - start);
+        size_t eq = token.find('=');
+        if (eq == std::string::npos || eq == 0) {
+            *error = "expected key=value: " + token;
+            return false;
+        }
+        std::string key = token.substr(0, eq), value = token.substr(eq + 1);
+        if (key == "trace") {
+            job->trace = value;
+            continue;
+        }
+        if (key == "id") {
+            job->id = value;
+            continue;
+        }
+
+        char* stop;
+        uint64_t v = strtoull(value.c_str(), &stop, 10);
+        if (value.empty() || *stop != '\0') {
+            *error = "not a number: " + token;
+            return false;
+        }
+        if (key == "r") job->r = v;
+        else if (key == "k0") job->k0 = v;
+        else if (key == "k1") job->k1 = v;
+        else if (key == "k2") job->k2 = v;
+        else if (key == "f") job->f = v;
+        else if (key == "begin") job->begin_dump = v;
+        else if (key == "end") job->end_dump = v;
+        else {
+            *error = "unknown key: " + key;
+            return false;
+        }
+    }
+
+    if (job->trace.empty()) {
+        *error = "no trace given";
+        return false;
+    }
+    if (!check_machine_param("r", job->r, error) || !check_machine_param("k0", job->k0, error)
+        || !check_machine_param("k1", job->k1, error) || !check_machine_param("k2", job->k2, error)
+        || !check_machine_param("f", job->f, error))
+        return false;
+    if ((job->begin_dump == 0) != (job->end_dump == 0) || job->end_dump < job->begin_dump) {
+        *error = "begin and end give a window of instructions, 1 <= begin <= end";
+        return false;
+    }
+    return true;
+}
+
+// queues the jobs of one client until it disconnects or asks for a
+// shutdown, which it returns true for
+static bool read_jobs(std::shared_ptr<connection_t> conn, job_queue_t* queue) {
+    FILE* in = fdopen(dup(conn->in_fd), "r");
+    if (in == NULL)
+        return false;
+
+    bool shutdown = false;
+    char* buf = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while (!shutdown && (len = getline(&buf, &cap, in)) >= 0) {
+        std::string line(buf, len);
+        while (!line.empty() && (line[line.size() - 1] == '\n' || line[line.size() - 1] == '\r'))
+            line.erase(line.size() - 1);
+        size_t first = line.find_first_not_of(" \t");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+        if (line.compare(first, std::string::npos, "shutdown") == 0) {
+            shutdown = true;
+            continue;
+        }
+
+        server_job_t job;
+        std::string error;
+        if (!parse_job(line, &job, &error)) {
+            conn->send(error_line(job.id, error));
+            continue;
+        }
+        job.conn = conn;
+        if (!queue->push(job))
+            conn->send(error_line(job.id, "the server is shutting down"));
+    }
+    free(buf);
+    fclose(in);
+    return shutdown;
+}
+
+// the socket path, ready to accept clients. -1 (and why on stderr) on failure
+static int listen_unix(const std::string &path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path.c_str());
+        return -1;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    // a socket left behind by an earlier server is replaced, anything else is not
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        fprintf(stderr, "Unable to listen on %s: %s\n", path.c_str(), strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// a client's reader thread. the connection itself lives as long as the
+// reader or any of its jobs, so that the client sees the socket close once
+// its last answer is sent
+struct client_t {
+    std::weak_ptr<connection_t> conn;
+    std::thread reader;
+    std::atomic<bool> done;
+};
+
+static void serve_client(std::shared_ptr<connection_t> conn, client_t* client, job_queue_t* queue, int listen_fd) {
+    if (read_jobs(conn, queue)) {
+        // wakes the accept loop, which then winds the server down
+        shutdown(listen_fd, SHUT_RDWR);
+    }
+    client->done = true;
+}
+
+// joins the readers that have finished, or all of them
+static void reap_clients(std::vector<client_t*> &clients, bool all) {
+    size_t kept = 0;
+    for (size_t i = 0; i < clients.size(); i++) {
+        if (all || clients[i]->done) {
+            clients[i]->reader.join();
+            delete clients[i];
+        } else {
+            clients[kept++] = clients[i];
+        }
+    }
+    clients.resize(kept);
+}
+
+int run_server(const server_config_t &config) {
+    // a client that disconnects early must not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = -1;
+    if (config.endpoint != "-" && (listen_fd = listen_unix(config.endpoint)) < 0)
+        return 1;
+
+    unsigned threads = config.threads;
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+
+    job_queue_t queue;
+    trace_cache_t cache;
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i++)
+        workers.push_back(std::thread(server_worker, &queue, &cache, &config));
+    fprintf(stderr, "Serving %s with %u workers\n", config.endpoint == "-" ? "standard input" : config.endpoint.c_str(), threads);
+
+    std::vector<client_t*> clients;
+    if (listen_fd < 0) {
+        read_jobs(std::shared_ptr<connection_t>(new connection_t(STDIN_FILENO, STDOUT_FILENO, false)), &queue);
+    } else {
+        int fd;
+        while ((fd = accept(listen_fd, NULL, NULL)) >= 0 || errno == EINTR) {
+            if (fd < 0)
+                continue;
+            reap_clients(clients, false);
+            std::shared_ptr<connection_t> conn(new connection_t(fd, fd, true));
+            client_t* client = new client_t();
+            client->conn = conn;
+            client->done = false;
+            client->reader = std::thread(serve_client, conn, client, &queue, listen_fd);
+            clients.push_back(client);
+        }
+        // stop the other clients' readers; what they queued is still answered
+        for (size_t i = 0; i < clients.size(); i++) {
+            std::shared_ptr<connection_t> conn = clients[i]->conn.lock();
+            if (conn)
+                shutdown(conn->in_fd, SHUT_RD);
+        }
+    }
+
+    queue.close();
+    reap_clients(clients, true);
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(config.endpoint.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "result_cache.hpp"
+
+/*
+  a resident simulation server. jobs arrive one per line,
+
+    trace=PATH [r=R] [k0=K0] [k1=K1] [k2=K2] [f=F] [begin=N end=N] [id=TOKEN]
+
+  with the machine parameters left out taking their defaults, and each is
+  answered with one line of JSON once it has run, in completion order (id
+  is echoed back to match them up). "shutdown" stops the server once the
+  jobs already queued have been answered. blank lines and lines starting
+  with # are ignored.
+
+  decoded traces stay in memory between jobs, keyed by path, and are
+  decoded again only when the file's modification time or size changes.
+*/
+struct server_config_t {
+    // "-" serves standard input and output, anything else is the path of
+    // a Unix socket to listen on
+    std::string endpoint;
+    // simulation workers, 0 for one per core
+    unsigned threads;
+    // applied to every job
+    proc_options_t options;
+    // where results of jobs without a timing dump are looked up and kept,
+    // NULL for nowhere
+    const result_cache_t* results;
+};
+
+// returns 0 once standard input ends or a shutdown is requested, and all
+// queued jobs have been answered. 1 if the socket cannot be set up
+int run_server(const server_config_t &config);
+
+#endif /* SERVER_H */
@@ -0,0 +1,205 @@
+#include "shard.hpp"
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+// keeps a shard's dump rows until the shards are stitched together
+class collect_timing_sink_t : public timing_sink_t {
+public:
+    void begin() { }
+    void write(const inst_timing_t &t) { rows.push_back(t); }
+    void end() { }
+
+    std::vector<inst_timing_t> rows;
+};
+
+struct shard_t {
+    // instructions [lo, hi) are counted, detailed simulation starts at
+    // start and training the predictor and caches at train
+    uint64_t train, start, lo, hi;
+    // the statistics when instruction lo retired and at the end
+    proc_stats_t first, last;
+    // cycles taken by the second half of the warm-up, and by the same
+    // instructions at the end of the shard (for the next one's warm-up;
+    // not known if the shard is shorter than that)
+    uint64_t head_cycles, tail_cycles;
+    bool tail_known;
+    collect_timing_sink_t dump;
+};
+
+// runs until the retired count (from the shard's start) reaches n, and
+// returns the cycle it got there
+static uint64_t run_to(processor_t* proc, proc_stats_t* stats, uint64_t n) {
+    if (n > 0) {
+        proc->set_stop(n);
+        proc->run(stats);
+    }
+    return stats->cycle_count;
+}
+
+static void simulate_shard(const trace_buffer_t* trace, const shard_config_t &config, shard_t* shard,
+                           uint64_t next_warmup) {
+    buffer_trace_source_t source(trace);
+    source.skip(shard->train);
+    processor_t proc(&source);
+    proc.set_options(config.options);
+    proc.set_timing_sink(&shard->dump);
+
+    // dump only the shard's own instructions, in its ids
+    uint64_t begin_dump = std::max(config.begin_dump, shard->lo + 1);
+    uint64_t end_dump = std::min(config.end_dump, shard->hi);
+    if (config.begin_dump == 0 || begin_dump > end_dump)
+        begin_dump = end_dump = 0;
+    else
+        begin_dump -= shard->start, end_dump -= shard->start;
+
+    proc_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    proc.setup(&stats, config.r, config.k0, config.k1, config.k2, config.f, begin_dump, end_dump);
+    proc.warm(shard->start - shard->train);
+
+    // detailed warm-up, timing its second half
+    uint64_t warm = shard->lo - shard->start;
+    uint64_t half = run_to(&proc, &stats, warm - warm / 2);
+    shard->head_cycles = run_to(&proc, &stats, warm) - half;
+    shard->first = stats;
+
+    // the shard itself. the next shard warms up on the end of this one
+    shard->tail_known = shard->hi < trace->size() && shard->hi - shard->lo >= next_warmup / 2;
+    if (shard->hi == trace->size()) {
+        proc.set_stop(0);
+        proc.run(&stats);
+    } else {
+        uint64_t tail = run_to(&proc, &stats, std::max(shard->hi - next_warmup / 2, shard->lo) - shard->start);
+        shard->tail_cycles = run_to(&proc, &stats, shard->hi - shard->start) - tail;
+    }
+    shard->last = stats;
+    proc.complete(&shard->last);
+
+    // instructions retire out of order, so the last of the shard's dump
+    // rows may still be waiting on an older one
+    uint64_t rows = begin_dump > 0 ? end_dump - begin_dump + 1 : 0;
+    while (shard->dump.rows.size() < rows && !proc.finished())
+        run_to(&proc, &stats, stats.retired_instruction + 1);
+}
+
+static void simulate_serial(const trace_buffer_t* trace, const shard_config_t &config, proc_stats_t* stats) {
+    buffer_trace_source_t source(trace);
+    processor_t proc(&source);
+    proc.set_options(config.options);
+    memset(stats, 0, sizeof(*stats));
+    proc.setup(stats, config.r, config.k0, config.k1, config.k2, config.f, 0, 0);
+    proc.run(stats);
+    proc.complete(stats);
+}
+
+// adds what the counters of last gained since first
+static void add_since(proc_stats_t* total, const proc_stats_t &first, const proc_stats_t &last) {
+    total->retired_instruction += last.retired_instruction - first.retired_instruction;
+    total->cycle_count += last.cycle_count - first.cycle_count;
+    total->max_disp_size = std::max(total->max_disp_size, last.max_disp_size);
+    total->sum_disp_size += last.sum_disp_size - first.sum_disp_size;
+    total->fetch_stall_cycles += last.fetch_stall_cycles - first.fetch_stall_cycles;
+    total->fetch_throttle_cycles += last.fetch_throttle_cycles - first.fetch_throttle_cycles;
+    total->branches += last.branches - first.branches;
+    total->mispredictions += last.mispredictions - first.mispredictions;
+    total->mispredict_stall_cycles += last.mispredict_stall_cycles - first.mispredict_stall_cycles;
+    total->mem_dep_loads += last.mem_dep_loads - first.mem_dep_loads;
+    for (int i = 0; i < CACHE_LEVELS; i++) {
+        total->cache_accesses[i] += last.cache_accesses[i] - first.cache_accesses[i];
+        total->cache_hits[i] += last.cache_hits[i] - first.cache_hits[i];
+    }
+    total->rob_full_cycles += last.rob_full_cycles - first.rob_full_cycles;
+}
+
+void run_sharded(const trace_buffer_t* trace, const shard_config_t &config, timing_sink_t* sink,
+                 proc_stats_t* p_stats, shard_result_t* result) {
+    memset(result, 0, sizeof(*result));
+    uint64_t n = trace->size();
+    unsigned count = std::max<uint64_t>(1, std::min<uint64_t>(config.shards, n));
+    std::vector<shard_t> shards(count);
+    for (unsigned i = 0; i < count; i++) {
+        shards[i].lo = n * i / count;
+        shards[i].hi = n * (i + 1) / count;
+        shards[i].start = shards[i].lo > config.warmup ? shards[i].lo - config.warmup : 0;
+        shards[i].train = shards[i].start > config.train ? shards[i].start - config.train : 0;
+    }
+
+    // job 0 is the serial check, if any, since it is the longest
+    unsigned first_job = config.check_serial ? 0 : 1;
+    unsigned jobs = count + 1;
+    unsigned threads = config.threads;
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+    threads = std::min(threads, jobs - first_job);
+
+    proc_stats_t serial;
+    std::atomic<unsigned> next(first_job);
+    auto worker = [&]() {
+        unsigned job;
+        while ((job = next++) < jobs) {
+            if (job == 0) {
+                simulate_serial(trace, config, &serial);
+            } else {
+                unsigned i = job - 1;
+                uint64_t next_warmup = i + 1 < count ? shards[i + 1].lo - shards[i + 1].start : 0;
+                simulate_shard(trace, config, &shards[i], next_warmup);
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+        pool.push_back(std::thread(worker));
+    worker();
+    for (size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+
+    // stitch the shards together back to back
+    memset(p_stats, 0, sizeof(*p_stats));
+    p_stats->cycle_count = 1;
+    if (config.begin_dump > 0)
+        sink->begin();
+    for (unsigned i = 0; i < count; i++) {
+        shard_t &s = shards[i];
+        uint64_t offset = p_stats->cycle_count;
+        for (size_t j = 0; j < s.dump.rows.size(); j++) {
+            inst_timing_t t = s.dump.rows[j];
+            t.id += s.start;
+            // a shard's front end starts only warmup instructions early, not
+            // as far ahead as the serial one would have been, so its FETCH
+            // and DISP stamps mean nothing in whole-trace cycles
+            if (i > 0) {
+                t.cycle_fetch_decode = 0;
+                t.cycle_dispatch = 0;
+            } else {
+                t.cycle_fetch_decode = t.cycle_fetch_decode + offset - s.first.cycle_count;
+                t.cycle_dispatch = t.cycle_dispatch + offset - s.first.cycle_count;
+            }
+            t.cycle_schedule = t.cycle_schedule + offset - s.first.cycle_count;
+            t.cycle_execute = t.cycle_execute + offset - s.first.cycle_count;
+            t.cycle_status_update = t.cycle_status_update + offset - s.first.cycle_count;
+            sink->write(t);
+        }
+        add_since(p_stats, s.first, s.last);
+        if (i > 0 && shards[i - 1].tail_known)
+            result->seam_cycles += s.head_cycles > shards[i - 1].tail_cycles ? s.head_cycles - shards[i - 1].tail_cycles
+                                                                              : shards[i - 1].tail_cycles - s.head_cycles;
+    }
+    if (config.begin_dump > 0)
+        sink->end();
+
+    // what complete() works out
+    p_stats->thread_retired[0] = p_stats->retired_instruction;
+    p_stats->thread_cycles[0] = p_stats->cycle_count;
+    p_stats->avg_disp_size = p_stats->sum_disp_size / p_stats->cycle_count;
+    p_stats->avg_inst_retired = p_stats->retired_instruction * 1.f / p_stats->cycle_count;
+
+    result->error_estimate = (double)result->seam_cycles / p_stats->cycle_count;
+    if (config.check_serial) {
+        result->serial_cycles = serial.cycle_count;
+        result->serial_error = ((double)p_stats->cycle_count - serial.cycle_count) / serial.cycle_count;
+    }
+}
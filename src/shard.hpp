@@ -0,0 +1,56 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "trace_buffer.hpp"
+#include "timing_sink.hpp"
+
+/*
+  sharded simulation of one long trace. the trace is cut into contiguous
+  shards by instruction index, simulated side by side from an empty
+  pipeline, each starting warmup instructions before its shard so the
+  register file and queues are full again by the time it counts. the
+  branch predictor and caches are trained on train instructions before
+  that, as sampling does between samples. the shards' cycles are then
+  added up as though they ran back to back, and so are the back end's
+  timing dump stamps. how far the front end runs ahead is lost at every
+  seam: after the first shard the dump's FETCH and DISP stamps are 0, and
+  the dispatch queue and fetch stall figures are only estimates.
+
+  the seams are not exact. each warm-up is checked against the shard
+  before it, which simulated the same instructions warm: the cycles the
+  second halves of the two disagree by, summed over the seams, are the
+  estimated error in the cycle count, over the shards at least that long. it cannot see a
+  predictor or caches trained too little, which stay cold well past the
+  warm-up.
+*/
+struct shard_config_t {
+    uint64_t r, k0, k1, k2, f;
+    proc_options_t options;
+    // the timing dump, by instruction id over the whole trace
+    uint64_t begin_dump;
+    uint64_t end_dump;
+
+    unsigned shards;
+    uint64_t warmup;
+    uint64_t train;
+    // simulation workers, 0 for one per core
+    unsigned threads;
+    // also simulate the whole trace serially, to measure the real error
+    bool check_serial;
+};
+
+struct shard_result_t {
+    uint64_t seam_cycles;
+    double error_estimate;      // seam_cycles / cycles
+    // with check_serial
+    uint64_t serial_cycles;
+    double serial_error;        // (sharded - serial) / serial cycles
+};
+
+// p_stats ends up as complete() would have left it after a serial run. the
+// timing dump rows are renumbered and shifted into whole-trace cycles and
+// written to sink
+void run_sharded(const trace_buffer_t* trace, const shard_config_t &config, timing_sink_t* sink,
+                 proc_stats_t* p_stats, shard_result_t* result);
+
+#endif /* SHARD_H */
@@ -0,0 +1,57 @@
+#include "stats.hpp"
+#include <inttypes.h>
+
+static void write_counts(FILE* out, const uint64_t* count, size_t n) {
+    // trailing zero buckets are left off
+    while (n > 1 && count[n - 1] == 0)
+        n--;
+    fprintf(out, "[");
+    for (size_t i = 0; i < n; i++)
+        fprintf(out, "%s%" PRIu64, i ? ", " : "", count[i]);
+    fprintf(out, "]");
+}
+
+void write_stats_json(FILE* out, const proc_stats_t &stats, const proc_detail_stats_t &detail) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"instructions\": %lu,\n", stats.retired_instruction);
+    fprintf(out, "  \"cycles\": %lu,\n", stats.cycle_count);
+    fprintf(out, "  \"ipc\": %f,\n", stats.avg_inst_retired);
+    fprintf(out, "  \"histogram_buckets\": {\"log2\": \"bucket 0 is 0, bucket i is [2^(i-1), 2^i)\", "
+            "\"linear\": \"bucket i is i, the last also counts everything above\"},\n");
+
+    fprintf(out, "  \"dispatch_queue_occupancy\": ");
+    write_counts(out, detail.dispatch_queue.count, 65);
+    fprintf(out, ",\n  \"scheduling_queue_occupancy\": ");
+    write_counts(out, detail.scheduling_queue.count, LINEAR_BUCKETS);
+
+    fprintf(out, ",\n  \"fu_utilization\": [");
+    for (int i = 0; i < NUM_FU_CLASSES; i++) {
+        uint64_t capacity = detail.fu_count[i] * stats.cycle_count;
+        fprintf(out, "%s%f", i ? ", " : "", capacity ? (double)detail.fu_busy[i] / capacity : 0.0);
+    }
+    fprintf(out, "],\n  \"cdb_utilization\": [");
+    uint64_t buses = detail.buses < STATS_MAX_BUSES ? detail.buses : STATS_MAX_BUSES;
+    for (uint64_t i = 0; i < buses; i++) {
+        // the last counter may hold any number of buses, averaged over them
+        uint64_t shared = i == STATS_MAX_BUSES - 1 ? detail.buses - i : 1;
+        uint64_t capacity = shared * stats.cycle_count;
+        fprintf(out, "%s%f", i ? ", " : "", capacity ? (double)detail.cdb_busy[i] / capacity : 0.0);
+    }
+    fprintf(out, "],\n");
+    if (detail.buses > STATS_MAX_BUSES)
+        fprintf(out, "  \"cdb_last_entry\": \"buses >= %d, the mean of the %" PRIu64 " of them\",\n",
+                STATS_MAX_BUSES - 1, detail.buses - (STATS_MAX_BUSES - 1));
+
+    fprintf(out, "  \"fire_stalls\": {\"operands\": %" PRIu64 ", \"structural\": %" PRIu64 "},\n",
+            detail.wait_operands, detail.wait_structural);
+
+    fprintf(out, "  \"latency\": {\n    \"dispatch_to_schedule\": ");
+    write_counts(out, detail.dispatch_wait.count, 65);
+    fprintf(out, ",\n    \"schedule_to_execute\": ");
+    write_counts(out, detail.schedule_wait.count, 65);
+    fprintf(out, ",\n    \"execute_to_state_update\": ");
+    write_counts(out, detail.execute_time.count, 65);
+    fprintf(out, ",\n    \"fetch_to_state_update\": ");
+    write_counts(out, detail.total_latency.count, 65);
+    fprintf(out, "\n  }\n}\n");
+}
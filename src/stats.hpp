@@ -0,0 +1,56 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "procsim.hpp"
+
+// bucket 0 counts zeros, bucket i values in [2^(i-1), 2^i)
+struct log2_histogram_t {
+    uint64_t count[65];
+
+    void add(uint64_t v, uint64_t n = 1) { count[v ? 64 - __builtin_clzll(v) : 0] += n; }
+};
+
+// one bucket per value, the last one also counting everything above it
+#define LINEAR_BUCKETS 128
+
+struct linear_histogram_t {
+    uint64_t count[LINEAR_BUCKETS];
+
+    void add(uint64_t v, uint64_t n = 1) { count[v < LINEAR_BUCKETS ? v : LINEAR_BUCKETS - 1] += n; }
+};
+
+// result buses tracked one by one; any beyond share the last counter
+#define STATS_MAX_BUSES 64
+
+/*
+  the optional detailed statistics, all fixed-size counters bumped by the
+  stages as they run. plain data: zero it with memset before the run.
+*/
+struct proc_detail_stats_t {
+    // occupancy sampled once a cycle
+    log2_histogram_t dispatch_queue;
+    linear_histogram_t scheduling_queue;
+
+    // units busy after firing, summed over cycles, and how many there are
+    uint64_t fu_busy[NUM_FU_CLASSES];
+    uint64_t fu_count[NUM_FU_CLASSES];
+    // cycles in which each result bus carried a result
+    uint64_t cdb_busy[STATS_MAX_BUSES];
+    uint64_t buses;
+
+    // instruction-cycles spent in the scheduling queue not firing: waiting
+    // on operands (or an older store), or ready but with no unit free
+    uint64_t wait_operands;
+    uint64_t wait_structural;
+
+    // per retired instruction, from its cycle_* stamps
+    log2_histogram_t dispatch_wait;    // DISP to SCHED
+    log2_histogram_t schedule_wait;    // SCHED to EXEC
+    log2_histogram_t execute_time;     // EXEC to STATE
+    log2_histogram_t total_latency;    // FETCH to STATE
+};
+
+// the basic and detailed statistics as one JSON object
+void write_stats_json(FILE* out, const proc_stats_t &stats, const proc_detail_stats_t &detail);
+
+#endif /* STATS_H */
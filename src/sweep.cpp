@@ -0,0 +1,195 @@
+#include "sweep.hpp"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <mutex>
+#include <thread>
+
+bool parse_param_list(const char* spec, std::vector<uint64_t>* values) {
+    std::string list(spec);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string item = list.substr(start, end - start);
+        if (item.empty())
+            return false;
+
+        // lo:hi[:step]
+        uint64_t range[3] = {0, 0, 1};
+        int n = 0;
+        size_t pos = 0;
+        while (n < 3) {
+            char* stop;
+            range[n++] = strtoull(item.c_str() + pos, &stop, 10);
+            if (stop == item.c_str() + pos)
+                return false;
+            pos = stop - item.c_str();
+            if (pos == item.size())
+                break;
+            if (item[pos] != ':')
+                return false;
+            pos++;
+        }
+        if (pos != item.size())
+            return false;
+
+        if (n == 1) {
+            values->push_back(range[0]);
+        } else {
+            if (range[2] == 0 || range[1] < range[0] || (range[1] - range[0]) / range[2] >= SWEEP_MAX_VALUES)
+                return false;
+            // stops before v + step could wrap past hi
+            for (uint64_t v = range[0]; ; v += range[2]) {
+                values->push_back(v);
+                if (range[1] - v < range[2])
+                    break;
+            }
+        }
+        start = end + 1;
+    }
+    return !values->empty();
+}
+
+bool check_machine_param(const char* name, uint64_t value, std::string* error) {
+    // no machine works without at least one of each, and far beyond any
+    // machine worth simulating is still small enough to allocate
+    char buf[128];
+    if (value < 1)
+        snprintf(buf, sizeof(buf), "%s must be at least 1", name);
+    else if (value > SWEEP_MAX_PARAM)
+        snprintf(buf, sizeof(buf), "%s must be at most %d", name, SWEEP_MAX_PARAM);
+    else
+        return true;
+    *error = buf;
+    return false;
+}
+
+/*
+  a small work-stealing pool. points are dealt out round-robin into one
+  deque per worker; a worker pops from the back of its own deque and, once
+  that runs dry, steals from the front of the others.
+*/
+struct sweep_worker_t {
+    std::mutex lock;
+    std::deque<size_t> work;
+};
+
+static bool next_point(std::vector<sweep_worker_t> &workers, unsigned self, size_t* index) {
+    {
+        std::lock_guard<std::mutex> guard(workers[self].lock);
+        if (!workers[self].work.empty()) {
+            *index = workers[self].work.back();
+            workers[self].work.pop_back();
+            return true;
+        }
+    }
+    for (unsigned i = 1; i < workers.size(); i++) {
+        sweep_worker_t &victim = workers[(self + i) % workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.work.empty()) {
+            *index = victim.work.front();
+            victim.work.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+static void simulate_point(sweep_point_t* point) {
+    std::string key;
+    if (point->results != NULL) {
+        key = result_key(point->trace->digest(), point->r, point->k0, point->k1, point->k2, point->f, *point->options);
+        if (point->results->lookup(key, &point->stats))
+            return;
+    }
+
+    buffer_trace_source_t source(point->trace);
+    processor_t proc(&source);
+    proc.set_options(*point->options);
+
+    memset(&point->stats, 0, sizeof(proc_stats_t));
+    proc.setup(&point->stats, point->r, point->k0, point->k1, point->k2, point->f, 0, 0);
+    proc.run(&point->stats);
+    proc.complete(&point->stats);
+    if (point->results != NULL)
+        point->results->store(key, point->stats);
+}
+
+static void sweep_worker(std::vector<sweep_worker_t>* workers, unsigned self, std::vector<sweep_point_t>* points) {
+    size_t index;
+    while (next_point(*workers, self, &index))
+        simulate_point(&(*points)[index]);
+}
+
+static void print_points(const std::vector<sweep_point_t> &points, sweep_format_t format, FILE* out) {
+    if (format == SWEEP_CSV) {
+        fprintf(out, "trace,r,k0,k1,k2,f,dq_limit,instructions,cycles,ipc,max_disp_size,avg_disp_size,fetch_stall_cycles,mispredictions\n");
+        for (size_t i = 0; i < points.size(); i++) {
+            const sweep_point_t &p = points[i];
+            fprintf(out, "%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%lu,%lu,%f,%lu,%f,%lu,%lu\n",
+                    p.trace->name.c_str(), p.r, p.k0, p.k1, p.k2, p.f, p.options->dispatch_queue_limit,
+                    p.stats.retired_instruction, p.stats.cycle_count, p.stats.avg_inst_retired,
+                    p.stats.max_disp_size, p.stats.avg_disp_size, p.stats.fetch_stall_cycles,
+                    p.stats.mispredictions);
+        }
+    } else {
+        fprintf(out, "[\n");
+        for (size_t i = 0; i < points.size(); i++) {
+            const sweep_point_t &p = points[i];
+            fprintf(out, "  {\"trace\": \"%s\", \"r\": %" PRIu64 ", \"k0\": %" PRIu64 ", \"k1\": %" PRIu64
+                    ", \"k2\": %" PRIu64 ", \"f\": %" PRIu64 ", \"dq_limit\": %" PRIu64 ", \"instructions\": %lu"
+                    ", \"cycles\": %lu, \"ipc\": %f, \"max_disp_size\": %lu, \"avg_disp_size\": %f"
+                    ", \"fetch_stall_cycles\": %lu, \"mispredictions\": %lu}%s\n",
+                    p.trace->name.c_str(), p.r, p.k0, p.k1, p.k2, p.f, p.options->dispatch_queue_limit,
+                    p.stats.retired_instruction, p.stats.cycle_count, p.stats.avg_inst_retired,
+                    p.stats.max_disp_size, p.stats.avg_disp_size, p.stats.fetch_stall_cycles,
+                    p.stats.mispredictions, i + 1 < points.size() ? "," : "");
+        }
+        fprintf(out, "]\n");
+    }
+}
+
+void run_sweep(const sweep_config_t &config, FILE* out) {
+    // expand the grid, in the order the rows are printed
+    std::vector<sweep_point_t> points;
+    for (size_t t = 0; t < config.traces.size(); t++)
+    for (size_t a = 0; a < config.r.size(); a++)
+    for (size_t b = 0; b < config.k0.size(); b++)
+    for (size_t c = 0; c < config.k1.size(); c++)
+    for (size_t d = 0; d < config.k2.size(); d++)
+    for (size_t e = 0; e < config.f.size(); e++) {
+        sweep_point_t p = sweep_point_t();
+        p.trace = config.traces[t];
+        p.r = config.r[a];
+        p.k0 = config.k0[b];
+        p.k1 = config.k1[c];
+        p.k2 = config.k2[d];
+        p.f = config.f[e];
+        p.options = &config.options;
+        p.results = config.results;
+        points.push_back(p);
+    }
+
+    unsigned threads = config.threads;
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+    if (threads > points.size())
+        threads = points.size() ? points.size() : 1;
+
+    std::vector<sweep_worker_t> workers(threads);
+    for (size_t i = 0; i < points.size(); i++)
+        workers[i % threads].work.push_back(i);
+
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++)
+        pool.push_back(std::thread(sweep_worker, &workers, i, &points));
+    sweep_worker(&workers, 0, &points);
+    for (size_t i = 0; i < pool.size(); i++)
+        pool[i].join();
+
+    print_points(points, config.format, out);
+}
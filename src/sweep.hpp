@@ -0,0 +1,56 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "result_cache.hpp"
+
+enum sweep_format_t { SWEEP_CSV, SWEEP_JSON };
+
+// the parameter grid of a design-space sweep. every combination of the
+// values below is simulated against every trace.
+struct sweep_config_t {
+    std::vector<const trace_buffer_t*> traces;
+    std::vector<uint64_t> r;
+    std::vector<uint64_t> k0;
+    std::vector<uint64_t> k1;
+    std::vector<uint64_t> k2;
+    std::vector<uint64_t> f;
+
+    // applied to every point
+    proc_options_t options;
+    // where finished points are looked up and kept, NULL for nowhere
+    const result_cache_t* results;
+
+    unsigned threads;
+    sweep_format_t format;
+};
+
+// one point of the sweep and its result
+struct sweep_point_t {
+    const trace_buffer_t* trace;
+    uint64_t r, k0, k1, k2, f;
+    const proc_options_t* options;
+    const result_cache_t* results;
+
+    proc_stats_t stats;
+};
+
+// values one lo:hi[:step] range may expand to, and the largest value
+// procsim accepts for a machine parameter
+#define SWEEP_MAX_VALUES 65536
+#define SWEEP_MAX_PARAM (1 << 20)
+
+// parses "a,b,c" and "lo:hi[:step]" lists (mixed freely) into values.
+// returns false on a malformed list or a range of more than
+// SWEEP_MAX_VALUES values.
+bool parse_param_list(const char* spec, std::vector<uint64_t>* values);
+
+// false, and why in *error, if value cannot be one of the machine
+// parameters (r, k0, k1, k2 or f): none of them may be 0, and none may be
+// more than SWEEP_MAX_PARAM. name is how the parameter is given
+bool check_machine_param(const char* name, uint64_t value, std::string* error);
+
+// simulates the whole grid on a work-stealing thread pool and prints one
+// row per point to out
+void run_sweep(const sweep_config_t &config, FILE* out);
+
+#endif /* SWEEP_H */
@@ -0,0 +1,74 @@
+#include "timing_sink.hpp"
+
+void buffered_writer_t::put(const void* data, size_t n) {
+    if (len + n > sizeof(buf)) {
+        flush();
+        if (n > sizeof(buf)) {
+            fwrite(data, 1, n, out);
+            return;
+        }
+    }
+    memcpy(buf + len, data, n);
+    len += n;
+}
+
+void buffered_writer_t::put_u64(uint64_t v) {
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    if (len + n > sizeof(buf))
+        flush();
+    while (n)
+        buf[len++] = digits[--n];
+}
+
+void buffered_writer_t::flush() {
+    if (len) {
+        fwrite(buf, 1, len, out);
+        len = 0;
+    }
+    fflush(out);
+}
+
+void text_timing_sink_t::begin() {
+    if (csv) {
+        writer.put("inst,fetch,disp,sched,exec,state\n");
+    } else {
+        writer.put("\nINST\tFETCH\tDISP\tSCHED\tEXEC\tSTATE\n");
+    }
+}
+
+void text_timing_sink_t::write(const inst_timing_t &t) {
+    char sep = csv ? ',' : '\t';
+    writer.put_u64(t.id);
+    writer.put(sep);
+    writer.put_u64(t.cycle_fetch_decode);
+    writer.put(sep);
+    writer.put_u64(t.cycle_dispatch);
+    writer.put(sep);
+    writer.put_u64(t.cycle_schedule);
+    writer.put(sep);
+    writer.put_u64(t.cycle_execute);
+    writer.put(sep);
+    writer.put_u64(t.cycle_status_update);
+    writer.put('\n');
+}
+
+void text_timing_sink_t::end() {
+    if (!csv)
+        writer.put('\n');
+    writer.flush();
+}
+
+void binary_timing_sink_t::write(const inst_timing_t &t) {
+    writer.put(&t.id, sizeof(t.id));
+    writer.put(&t.cycle_fetch_decode, sizeof(uint64_t));
+    writer.put(&t.cycle_dispatch, sizeof(uint64_t));
+    writer.put(&t.cycle_schedule, sizeof(uint64_t));
+    writer.put(&t.cycle_execute, sizeof(uint64_t));
+    writer.put(&t.cycle_status_update, sizeof(uint64_t));
+}
@@ -0,0 +1,64 @@
+#ifndef TIMING_SINK_H
+#define TIMING_SINK_H
+
+#include "procsim.hpp"
+#include <string.h>
+
+// where the per-instruction timing dump goes. rows arrive in id order as
+// instructions retire.
+class timing_sink_t {
+public:
+    virtual ~timing_sink_t() { }
+
+    virtual void begin() = 0;
+    virtual void write(const inst_timing_t &t) = 0;
+    virtual void end() = 0;
+};
+
+// collects bytes and hands them to the FILE in large blocks
+class buffered_writer_t {
+public:
+    buffered_writer_t(FILE* out) : out(out), len(0) { }
+    ~buffered_writer_t() { flush(); }
+
+    void put(const void* data, size_t n);
+    void put(const char* s) { put(s, strlen(s)); }
+    void put(char c) { if (len == sizeof(buf)) flush(); buf[len++] = c; }
+    void put_u64(uint64_t v);
+    void flush();
+
+private:
+    FILE* out;
+    size_t len;
+    char buf[1 << 16];
+};
+
+// the INST/FETCH/DISP/SCHED/EXEC/STATE table, tab separated between blank
+// lines as procsim has always printed it, or as plain comma separated values
+class text_timing_sink_t : public timing_sink_t {
+public:
+    text_timing_sink_t(FILE* out, bool csv = false) : writer(out), csv(csv) { }
+
+    void begin();
+    void write(const inst_timing_t &t);
+    void end();
+
+private:
+    buffered_writer_t writer;
+    bool csv;
+};
+
+// raw little-endian records: uint32 id, then five uint64 cycle stamps
+class binary_timing_sink_t : public timing_sink_t {
+public:
+    binary_timing_sink_t(FILE* out) : writer(out) { }
+
+    void begin() { }
+    void write(const inst_timing_t &t);
+    void end() { writer.flush(); }
+
+private:
+    buffered_writer_t writer;
+};
+
+#endif /* TIMING_SINK_H */
@@ -0,0 +1,273 @@
+#include "trace_buffer.hpp"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool is_ctrace_file(const std::string &filename) {
+    char magic[8];
+    FILE* in = fopen(filename.c_str(), "rb");
+    if (in == NULL)
+        return false;
+    bool match = fread(magic, 1, sizeof(magic), in) == sizeof(magic) && memcmp(magic, CTRACE_MAGIC, 8) == 0;
+    fclose(in);
+    return match;
+}
+
+trace_buffer_t::trace_buffer_t()
+    : count(0), packed_ops(false), map(NULL), map_bytes(0) {
+    for (int c = 0; c < CT_NUM_COLUMNS; c++)
+        column[c] = NULL;
+}
+
+trace_buffer_t::~trace_buffer_t() {
+    if (map != NULL)
+        munmap(map, map_bytes);
+}
+
+// bytes per instruction in each column (but see CTRACE_PACKED_OPS)
+static const uint32_t column_width[CT_NUM_COLUMNS] = { 1, 1, 1, 1, 4, 1, 8 };
+
+static uint64_t column_bytes(int c, uint64_t count, bool packed_ops) {
+    return (c == CT_OP_CODE && packed_ops) ? (count + 3) / 4 : count * column_width[c];
+}
+
+// whether count entries of column c fit in room bytes, without working out
+// column_bytes, which a corrupt count could wrap around
+static bool column_fits(int c, uint64_t count, bool packed_ops, uint64_t room) {
+    if (c == CT_OP_CODE && packed_ops)
+        return count / 4 + (count % 4 != 0) <= room;
+    return count <= room / column_width[c];
+}
+
+void trace_buffer_t::get(uint64_t i, proc_inst_t* p_inst) const {
+    p_inst->instruction_address = inst_addr(i);
+    p_inst->op_code = op_code(i);
+    p_inst->dest_reg = dest_reg(i);
+    p_inst->src_reg[0] = src_reg(i, 0);
+    p_inst->src_reg[1] = src_reg(i, 1);
+    p_inst->flags = flags(i);
+    p_inst->mem_addr = mem_addr(i);
+}
+
+const trace_digest_t &trace_buffer_t::digest() const {
+    std::call_once(digest_once, [this]() {
+        proc_inst_t inst;
+        for (uint64_t i = 0; i < count; i++) {
+            get(i, &inst);
+            digest_value.add(inst);
+        }
+    });
+    return digest_value;
+}
+
+static bool encode_reg(int32_t reg, uint8_t* out) {
+    if (reg == -1) {
+        *out = CTRACE_NO_REG;
+        return true;
+    }
+    if (reg < 0 || reg >= CTRACE_NO_REG)
+        return false;
+    *out = reg;
+    return true;
+}
+
+bool trace_buffer_t::append(const proc_inst_t &inst) {
+    if (map != NULL || packed_ops)
+        return false;
+
+    uint8_t regs[3];
+    if (!encode_reg(inst.dest_reg, &regs[0]) || !encode_reg(inst.src_reg[0], &regs[1])
+        || !encode_reg(inst.src_reg[1], &regs[2]))
+        return false;
+
+    storage[CT_OP_CODE].push_back(inst.op_code);
+    storage[CT_DEST_REG].push_back(regs[0]);
+    storage[CT_SRC1_REG].push_back(regs[1]);
+    storage[CT_SRC2_REG].push_back(regs[2]);
+    storage[CT_INST_ADDR].insert(storage[CT_INST_ADDR].end(), (const uint8_t*)&inst.instruction_address,
+                                 (const uint8_t*)&inst.instruction_address + 4);
+    storage[CT_FLAGS].push_back(inst.flags);
+    storage[CT_MEM_ADDR].insert(storage[CT_MEM_ADDR].end(), (const uint8_t*)&inst.mem_addr,
+                                (const uint8_t*)&inst.mem_addr + 8);
+    for (int c = 0; c < CT_NUM_COLUMNS; c++)
+        column[c] = storage[c].data();
+    count++;
+    return true;
+}
+
+static uint64_t align_up(uint64_t v) {
+    return (v + CTRACE_ALIGN - 1) & ~(uint64_t)(CTRACE_ALIGN - 1);
+}
+
+bool trace_buffer_t::map_file(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open trace file %s: %s\n", filename.c_str(), strerror(errno));
+        return false;
+    }
+    // a version 1 header only has the first four offsets
+    const off_t v1_header = sizeof(ctrace_header_t) - (CT_NUM_COLUMNS - CT_V1_COLUMNS) * sizeof(uint64_t);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < v1_header) {
+        fprintf(stderr, "Not a ctrace file: %s\n", filename.c_str());
+        close(fd);
+        return false;
+    }
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "Unable to map trace file %s: %s\n", filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    const ctrace_header_t* header = (const ctrace_header_t*)addr;
+    bool valid = memcmp(header->magic, CTRACE_MAGIC, 8) == 0
+        && (header->version == 1 || (header->version == CTRACE_VERSION && st.st_size >= (off_t)sizeof(ctrace_header_t)));
+    int columns = valid && header->version == 1 ? CT_V1_COLUMNS : CT_NUM_COLUMNS;
+    uint64_t header_bytes = columns == CT_V1_COLUMNS ? v1_header : sizeof(ctrace_header_t);
+    bool packed = header->flags & CTRACE_PACKED_OPS;
+    for (int c = 0; valid && c < columns; c++) {
+        // only the first four columns are required
+        if (c >= CT_V1_COLUMNS && header->offset[c] == 0)
+            continue;
+        valid = header->offset[c] >= header_bytes && header->offset[c] <= (uint64_t)st.st_size
+            && column_fits(c, header->count, packed, st.st_size - header->offset[c]);
+    }
+    if (!valid) {
+        fprintf(stderr, "Corrupt or unsupported ctrace file: %s\n", filename.c_str());
+        munmap(addr, st.st_size);
+        return false;
+    }
+
+    if (map != NULL)
+        munmap(map, map_bytes);
+    for (int c = 0; c < CT_NUM_COLUMNS; c++) {
+        storage[c].clear();
+        bool present = c < columns && (c < CT_V1_COLUMNS || header->offset[c] != 0);
+        column[c] = present ? (const uint8_t*)addr + header->offset[c] : NULL;
+    }
+    map = addr;
+    map_bytes = st.st_size;
+    count = header->count;
+    packed_ops = packed;
+    madvise(map, map_bytes, MADV_SEQUENTIAL);
+    return true;
+}
+
+bool trace_buffer_t::write_file(const std::string &filename, bool pack_ops) const {
+    std::vector<uint8_t> cols[CT_NUM_COLUMNS];
+    for (int c = 0; c < CT_NUM_COLUMNS; c++) {
+        if (column[c] != NULL)
+            cols[c].assign(column[c], column[c] + column_bytes(c, count, packed_ops));
+    }
+
+    if (pack_ops != packed_ops) {
+        std::vector<uint8_t> ops(pack_ops ? (count + 3) / 4 : count, 0);
+        for (uint64_t i = 0; i < count; i++) {
+            if (pack_ops)
+                ops[i >> 2] |= op_code(i) << ((i & 3) * 2);
+            else
+                ops[i] = op_code(i);
+        }
+        cols[CT_OP_CODE].swap(ops);
+    }
+
+    ctrace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CTRACE_MAGIC, 8);
+    header.version = CTRACE_VERSION;
+    header.flags = pack_ops ? CTRACE_PACKED_OPS : 0;
+    header.count = count;
+    uint64_t offset = align_up(sizeof(header));
+    for (int c = 0; c < CT_NUM_COLUMNS; c++) {
+        if (c >= CT_V1_COLUMNS && column[c] == NULL)
+            continue;
+        header.offset[c] = offset;
+        offset = align_up(offset + cols[c].size());
+    }
+
+    FILE* out = fopen(filename.c_str(), "wb");
+    if (out == NULL) {
+        fprintf(stderr, "Unable to create %s: %s\n", filename.c_str(), strerror(errno));
+        return false;
+    }
+    static const uint8_t zeros[CTRACE_ALIGN] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    uint64_t pos = sizeof(header);
+    for (int c = 0; ok && c < CT_NUM_COLUMNS; c++) {
+        if (header.offset[c] == 0)
+            continue;
+        ok = fwrite(zeros, 1, header.offset[c] - pos, out) == header.offset[c] - pos
+            && fwrite(cols[c].data(), 1, cols[c].size(), out) == cols[c].size();
+        pos = header.offset[c] + cols[c].size();
+    }
+    if (fclose(out) != 0 || !ok) {
+        fprintf(stderr, "Error writing %s\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool load_trace_buffer(trace_source_t* source, trace_buffer_t* buffer){
+    proc_inst_t inst = proc_inst_t();
+    while(source->read_instruction(&inst)){
+        if(!buffer->append(inst))
+            return false;
+    }
+    return true;
+}
+
+bool load_trace_buffer(trace_reader_t* reader, trace_buffer_t* buffer){
+    const Trace_Rec* records;
+    size_t n;
+    proc_inst_t inst;
+    while((n = reader->next_batch(&records, TRACE_CHUNK_RECORDS)) > 0){
+        for(size_t i = 0; i < n; i++){
+            decode_trace_rec(records[i], &inst);
+            if(!buffer->append(inst))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool open_trace_buffer(const std::string &filename, trace_buffer_t* buffer){
+    buffer->name = filename;
+    if (is_ctrace_file(filename))
+        return buffer->map_file(filename);
+
+    trace_reader_t reader;
+    if (!reader.open(filename))
+        return false;
+    if (!load_trace_buffer(&reader, buffer)) {
+        fprintf(stderr, "Trace %s has a register the simulator cannot hold\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+//
+// buffer_trace_source_t::read_instruction
+//
+//  returns true if an instruction was read successfully
+//
+bool buffer_trace_source_t::read_instruction(proc_inst_t* p_inst){
+    if(buffer == NULL || pos >= buffer->size()){
+        return false;
+    }
+
+    buffer->get(pos++, p_inst);
+    return true;
+}
+
+uint64_t buffer_trace_source_t::skip(uint64_t n){
+    uint64_t left = buffer == NULL ? 0 : buffer->size() - pos;
+    if(n > left){
+        n = left;
+    }
+    pos += n;
+    return n;
+}
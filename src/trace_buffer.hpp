@@ -0,0 +1,144 @@
+#ifndef TRACE_BUFFER_H
+#define TRACE_BUFFER_H
+
+#include "trace_reader.hpp"
+#include <string.h>
+#include <mutex>
+
+/*
+  compact columnar trace (".ctr") file layout. a header followed by one
+  column per field the pipeline consumes, each 64-byte aligned:
+
+    op_code   2 bits per instruction, four to a byte (or one byte with -u)
+    dest_reg  one byte per instruction, CTRACE_NO_REG if not needed
+    src1_reg  "
+    src2_reg  "
+    inst_addr low 32 bits of the instruction address
+    flags     one byte of INST_BRANCH/TAKEN/LOAD/STORE
+    mem_addr  8 bytes, the load or store address
+
+  the first four columns, about 3.25 bytes per instruction against 48 for
+  a raw Trace_Rec, are all version 1 files have; the last three (offset 0
+  when absent) feed branch prediction and memory dependences.
+*/
+#define CTRACE_MAGIC "PSIMCTR1"
+#define CTRACE_VERSION 2
+#define CTRACE_NO_REG 0xff
+#define CTRACE_ALIGN 64
+
+// header flags
+#define CTRACE_PACKED_OPS 0x1
+
+enum ctrace_column_t {
+    CT_OP_CODE,
+    CT_DEST_REG,
+    CT_SRC1_REG,
+    CT_SRC2_REG,
+    CT_INST_ADDR,
+    CT_FLAGS,
+    CT_MEM_ADDR,
+    CT_NUM_COLUMNS
+};
+
+// the columns of a version 1 file
+#define CT_V1_COLUMNS (CT_SRC2_REG + 1)
+
+struct ctrace_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t count;
+    uint64_t offset[CT_NUM_COLUMNS];
+};
+
+// true if the file starts with a ctrace header
+bool is_ctrace_file(const std::string &filename);
+
+/*
+  a trace decoded once into memory in structure-of-arrays form, shared
+  read-only between simulations. the columns are either built in memory
+  with append() or point straight into an mmap'd ctrace file.
+*/
+class trace_buffer_t {
+public:
+    trace_buffer_t();
+    ~trace_buffer_t();
+
+    std::string name;
+
+    uint64_t size() const { return count; }
+
+    int32_t op_code(uint64_t i) const {
+        if (packed_ops)
+            return (column[CT_OP_CODE][i >> 2] >> ((i & 3) * 2)) & 3;
+        return column[CT_OP_CODE][i];
+    }
+    int32_t dest_reg(uint64_t i) const { return reg_value(column[CT_DEST_REG][i]); }
+    int32_t src_reg(uint64_t i, int k) const { return reg_value(column[CT_SRC1_REG + k][i]); }
+    uint32_t inst_addr(uint64_t i) const { return column[CT_INST_ADDR] ? load<uint32_t>(CT_INST_ADDR, i) : 0; }
+    uint8_t flags(uint64_t i) const { return column[CT_FLAGS] ? column[CT_FLAGS][i] : 0; }
+    uint64_t mem_addr(uint64_t i) const { return column[CT_MEM_ADDR] ? load<uint64_t>(CT_MEM_ADDR, i) : 0; }
+
+    // fills the pipeline fields of p_inst from instruction i
+    void get(uint64_t i, proc_inst_t* p_inst) const;
+
+    // the trace_digest_t of every instruction, worked out on first use
+    const trace_digest_t &digest() const;
+
+    // adds a decoded instruction. returns false if it cannot be stored
+    // (a register number that does not fit the format)
+    bool append(const proc_inst_t &inst);
+
+    // zero-copy load of a ctrace file. says why on stderr on failure
+    bool map_file(const std::string &filename);
+    bool write_file(const std::string &filename, bool pack_ops) const;
+
+private:
+    trace_buffer_t(const trace_buffer_t&);
+    trace_buffer_t& operator=(const trace_buffer_t&);
+
+    static int32_t reg_value(uint8_t reg) { return reg == CTRACE_NO_REG ? -1 : reg; }
+    template <typename T> T load(int c, uint64_t i) const {
+        T v;
+        memcpy(&v, column[c] + i * sizeof(T), sizeof(T));
+        return v;
+    }
+
+    uint64_t count;
+    bool packed_ops;
+    // NULL for a column the file does not have
+    const uint8_t* column[CT_NUM_COLUMNS];
+
+    // columns built in memory (unpacked)
+    std::vector<uint8_t> storage[CT_NUM_COLUMNS];
+
+    // or the mapped file backing them
+    void* map;
+    size_t map_bytes;
+
+    mutable std::once_flag digest_once;
+    mutable trace_digest_t digest_value;
+};
+
+// drains a trace source into a buffer. returns false if an instruction
+// could not be stored
+bool load_trace_buffer(trace_source_t* source, trace_buffer_t* buffer);
+// same, decoding a reader's records a whole batch at a time
+bool load_trace_buffer(trace_reader_t* reader, trace_buffer_t* buffer);
+// maps a ctrace file or decodes any other trace into buffer
+bool open_trace_buffer(const std::string &filename, trace_buffer_t* buffer);
+
+// trace source replaying a shared, read-only trace buffer
+class buffer_trace_source_t : public trace_source_t {
+public:
+    buffer_trace_source_t(const trace_buffer_t* buffer) : buffer(buffer), pos(0) { }
+
+    bool read_instruction(proc_inst_t* p_inst);
+    uint64_t skip(uint64_t n);
+
+private:
+    const trace_buffer_t* buffer;
+    uint64_t pos;
+};
+
+#endif /* TRACE_BUFFER_H */
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "trace_buffer.hpp"
+
+/*
+  converts a gzip'd (or raw) Trace_Rec trace to the compact columnar
+  ctrace format that procsim maps without decoding
+*/
+void print_help_and_exit(void) {
+    printf("trace_convert [OPTIONS] in.trace out.ctr\n");
+    printf("  -u\t\tDo not bit-pack the op_code column\n");
+    printf("  -h\t\tThis helpful output\n");
+    exit(0);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    bool pack_ops = true;
+
+    while(-1 != (opt = getopt(argc, argv, "uh"))) {
+        switch(opt) {
+        case 'u':
+            pack_ops = false;
+            break;
+        case 'h':
+            /* Fall through */
+        default:
+            print_help_and_exit();
+            break;
+        }
+    }
+    if (argc - optind != 2)
+        print_help_and_exit();
+
+    trace_buffer_t buffer;
+    if (!open_trace_buffer(argv[optind], &buffer))
+        return 1;
+    if (!buffer.write_file(argv[optind + 1], pack_ops))
+        return 1;
+
+    printf("Converted %lu instructions: %s -> %s\n", (unsigned long)buffer.size(), argv[optind], argv[optind + 1]);
+    return 0;
+}
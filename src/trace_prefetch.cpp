@@ -0,0 +1,98 @@
+#include "trace_prefetch.hpp"
+#include <algorithm>
+
+prefetch_trace_source_t::prefetch_trace_source_t(trace_reader_t* reader)
+    : reader(reader), ring(PREFETCH_RING_SLOTS), head(0), done(false), tail_seen(0),
+      tail(0), stop(false), head_seen(0) {
+    producer = std::thread(&prefetch_trace_source_t::produce, this);
+}
+
+prefetch_trace_source_t::~prefetch_trace_source_t() {
+    stop.store(true, std::memory_order_relaxed);
+    producer.join();
+}
+
+void prefetch_trace_source_t::produce() {
+    const Trace_Rec* records;
+    size_t n = 0, next = 0;
+    uint64_t h = 0;
+    proc_inst_t inst;
+    while (!stop.load(std::memory_order_relaxed)) {
+        if (next == n) {
+            n = reader->next_batch(&records, PREFETCH_BATCH);
+            next = 0;
+            if (n == 0)
+                break;
+        }
+        // wait for the consumer to free up room
+        if (h - tail_seen == PREFETCH_RING_SLOTS) {
+            tail_seen = tail.load(std::memory_order_acquire);
+            if (h - tail_seen == PREFETCH_RING_SLOTS) {
+                std::this_thread::yield();
+                continue;
+            }
+        }
+        size_t m = std::min<uint64_t>(n - next, PREFETCH_RING_SLOTS - (h - tail_seen));
+        for (size_t i = 0; i < m; i++, h++) {
+            decode_trace_rec(records[next + i], &inst);
+            slot_t &s = ring[h & (PREFETCH_RING_SLOTS - 1)];
+            s.mem_addr = inst.mem_addr;
+            s.instruction_address = inst.instruction_address;
+            s.dest_reg = inst.dest_reg;
+            s.src_reg[0] = inst.src_reg[0];
+            s.src_reg[1] = inst.src_reg[1];
+            s.op_code = inst.op_code;
+            s.flags = inst.flags;
+        }
+        next += m;
+        head.store(h, std::memory_order_release);
+    }
+    done.store(true, std::memory_order_release);
+}
+
+uint64_t prefetch_trace_source_t::available() {
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    while (head_seen == t) {
+        // done is set after the last slot is published, so look at head once more
+        bool ended = done.load(std::memory_order_acquire);
+        head_seen = head.load(std::memory_order_acquire);
+        if (head_seen == t) {
+            if (ended)
+                return 0;
+            std::this_thread::yield();
+        }
+    }
+    return head_seen - t;
+}
+
+//
+// prefetch_trace_source_t::read_instruction
+//
+//  returns true if an instruction was read successfully
+//
+bool prefetch_trace_source_t::read_instruction(proc_inst_t* p_inst) {
+    if (available() == 0)
+        return false;
+
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    const slot_t &s = ring[t & (PREFETCH_RING_SLOTS - 1)];
+    p_inst->instruction_address = s.instruction_address;
+    p_inst->op_code = s.op_code;
+    p_inst->dest_reg = s.dest_reg;
+    p_inst->src_reg[0] = s.src_reg[0];
+    p_inst->src_reg[1] = s.src_reg[1];
+    p_inst->flags = s.flags;
+    p_inst->mem_addr = s.mem_addr;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+uint64_t prefetch_trace_source_t::skip(uint64_t n) {
+    uint64_t skipped = 0, m;
+    while (skipped < n && (m = available()) > 0) {
+        m = std::min(m, n - skipped);
+        tail.store(tail.load(std::memory_order_relaxed) + m, std::memory_order_release);
+        skipped += m;
+    }
+    return skipped;
+}
@@ -0,0 +1,67 @@
+#ifndef TRACE_PREFETCH_H
+#define TRACE_PREFETCH_H
+
+#include "trace_reader.hpp"
+#include <atomic>
+#include <thread>
+
+// decoded instructions the producer may run ahead by (a power of two), and
+// how many it decodes between publishing them
+#define PREFETCH_RING_SLOTS (1 << 16)
+#define PREFETCH_BATCH 1024
+
+/*
+  takes inflating and decoding a trace off the simulation thread. a
+  producer thread reads the trace_reader_t a batch at a time and decodes
+  it into a single-producer, single-consumer ring; fetch only copies the
+  decoded fields back out. each side keeps its own index on a cache line
+  of its own and reads the other's only when it runs out.
+*/
+class prefetch_trace_source_t : public trace_source_t {
+public:
+    // starts the producer. reader must stay open until this is destroyed
+    prefetch_trace_source_t(trace_reader_t* reader);
+    ~prefetch_trace_source_t();
+
+    bool read_instruction(proc_inst_t* p_inst);
+    uint64_t skip(uint64_t n);
+
+private:
+    prefetch_trace_source_t(const prefetch_trace_source_t&);
+    prefetch_trace_source_t& operator=(const prefetch_trace_source_t&);
+
+    // the fields decode_trace_rec fills, 32 bytes a slot
+    struct slot_t {
+        uint64_t mem_addr;
+        uint32_t instruction_address;
+        int32_t dest_reg;
+        int32_t src_reg[2];
+        uint8_t op_code;
+        uint8_t flags;
+    };
+
+    void produce();
+    // instructions ready to be consumed, waiting for the producer if there
+    // are none. 0 at the end of the trace
+    uint64_t available();
+
+    trace_reader_t* reader;
+    std::vector<slot_t> ring;
+
+    // producer side: slots published, and set once the trace has ended
+    std::atomic<uint64_t> head;
+    std::atomic<bool> done;
+    uint64_t tail_seen;
+
+    // keeps the two sides off each other's cache line
+    char pad[64];
+
+    // consumer side: slots consumed, and set to stop the producer early
+    std::atomic<uint64_t> tail;
+    std::atomic<bool> stop;
+    uint64_t head_seen;
+
+    std::thread producer;
+};
+
+#endif /* TRACE_PREFETCH_H */
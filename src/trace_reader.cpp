@@ -0,0 +1,188 @@
+#include "trace_reader.hpp"
+#include <string.h>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+void decode_trace_rec(const Trace_Rec &tr_entry, proc_inst_t* p_inst){
+    p_inst->instruction_address = tr_entry.inst_addr;
+
+    if(tr_entry.op_type == OP_LD || tr_entry.op_type == OP_ST){
+        p_inst->op_code = 1;
+    }else if(tr_entry.op_type == OP_CBR){
+        p_inst->op_code = 2;
+    }else{
+        // OP_ALU, OP_OTHER and anything unknown
+        p_inst->op_code = 0;
+    }
+
+    if(tr_entry.dest_needed == 1){
+        p_inst->dest_reg = tr_entry.dest;
+    }else{
+        p_inst->dest_reg = (-1);
+    }
+
+    if(tr_entry.src1_needed == 1){
+        p_inst->src_reg[0] = tr_entry.src1_reg;
+    }else{
+        p_inst->src_reg[0] = (-1);
+    }
+
+    if(tr_entry.src2_needed == 1){
+        p_inst->src_reg[1] = tr_entry.src2_reg;
+    }else{
+        p_inst->src_reg[1] = (-1);
+    }
+
+    // what branch prediction and memory dependences need
+    p_inst->flags = 0;
+    if(tr_entry.op_type == OP_CBR){
+        p_inst->flags |= INST_BRANCH;
+        if(tr_entry.br_dir){
+            p_inst->flags |= INST_TAKEN;
+        }
+    }
+    if(tr_entry.mem_read){
+        p_inst->flags |= INST_LOAD;
+    }
+    if(tr_entry.mem_write){
+        p_inst->flags |= INST_STORE;
+    }
+    p_inst->mem_addr = (p_inst->flags & (INST_LOAD | INST_STORE)) ? tr_entry.mem_addr : 0;
+}
+
+trace_reader_t::trace_reader_t()
+    : gz(NULL), map(NULL), map_bytes(0), avail(0), pos(0), digest(NULL) { }
+
+trace_reader_t::~trace_reader_t() {
+    close();
+}
+
+bool trace_reader_t::open(const std::string &filename) {
+    close();
+
+    int fd;
+    if (filename == "-") {
+        fd = dup(STDIN_FILENO);
+    } else {
+        fd = ::open(filename.c_str(), O_RDONLY);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open trace file %s: %s\n", filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    // uncompressed regular files are mapped and read in place
+    unsigned char magic[2] = {0, 0};
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= (off_t)sizeof(Trace_Rec)
+        && pread(fd, magic, 2, 0) == 2 && !(magic[0] == 0x1f && magic[1] == 0x8b)) {
+        void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            ::close(fd);
+            map = (const Trace_Rec*)addr;
+            map_bytes = st.st_size;
+            avail = map_bytes / sizeof(Trace_Rec);
+            return true;
+        }
+    }
+
+    // gzip (or a pipe); zlib passes non-gzip data through unchanged
+    gz = gzdopen(fd, "rb");
+    if (gz == NULL) {
+        fprintf(stderr, "Unable to read trace file %s\n", filename.c_str());
+        ::close(fd);
+        return false;
+    }
+    gzbuffer(gz, 1 << 20);
+    chunk.resize(TRACE_CHUNK_RECORDS);
+    return true;
+}
+
+void trace_reader_t::close() {
+    if (gz != NULL) {
+        gzclose(gz);
+        gz = NULL;
+    }
+    if (map != NULL) {
+        munmap((void*)map, map_bytes);
+        map = NULL;
+        map_bytes = 0;
+    }
+    avail = 0;
+    pos = 0;
+}
+
+// inflates the next chunk of whole records
+bool trace_reader_t::fill_chunk() {
+    int bytes = gzread(gz, chunk.data(), chunk.size() * sizeof(Trace_Rec));
+    if (bytes < 0) {
+        int err;
+        fprintf(stderr, "Error reading trace: %s\n", gzerror(gz, &err));
+        bytes = 0;
+    }
+    // a trailing partial record ends the trace
+    avail = bytes / sizeof(Trace_Rec);
+    pos = 0;
+    return avail > 0;
+}
+
+size_t trace_reader_t::next_batch(const Trace_Rec** records, size_t max) {
+    size_t n;
+    if (map != NULL) {
+        n = std::min(max, avail - pos);
+        *records = map + pos;
+    } else {
+        if (gz == NULL)
+            return 0;
+        if (pos == avail && !fill_chunk())
+            return 0;
+        n = std::min(max, avail - pos);
+        *records = chunk.data() + pos;
+    }
+    pos += n;
+
+    if (digest != NULL) {
+        proc_inst_t inst;
+        for (size_t i = 0; i < n; i++) {
+            decode_trace_rec((*records)[i], &inst);
+            digest->add(inst);
+        }
+    }
+    return n;
+}
+
+//
+// trace_reader_t::read_instruction
+//
+//  returns true if an instruction was read successfully
+//
+bool trace_reader_t::read_instruction(proc_inst_t* p_inst){
+    if (p_inst == NULL){
+        fprintf(stderr, "Fetch requires a valid pointer to populate\n");
+        return false;
+    }
+
+    const Trace_Rec* tr_entry;
+    if (next_batch(&tr_entry, 1) == 0) {
+        return false;
+    }
+
+    decode_trace_rec(*tr_entry, p_inst);
+    return true;
+}
+
+// passes over records a whole batch at a time, without decoding them
+uint64_t trace_reader_t::skip(uint64_t n){
+    const Trace_Rec* records;
+    uint64_t skipped = 0;
+    size_t got;
+    while (skipped < n && (got = next_batch(&records, std::min<uint64_t>(n - skipped, TRACE_CHUNK_RECORDS))) > 0) {
+        skipped += got;
+    }
+    return skipped;
+}
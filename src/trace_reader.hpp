@@ -0,0 +1,91 @@
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include "procsim.hpp"
+#include <zlib.h>
+
+// records handed out per batch, and decompressed per chunk
+#define TRACE_CHUNK_RECORDS 16384
+
+// converts one raw trace record to the fields the pipeline consumes
+void decode_trace_rec(const Trace_Rec &tr_entry, proc_inst_t* p_inst);
+
+// a running hash of decoded instructions, so a trace has the same digest
+// whichever file format it is read from
+class trace_digest_t {
+public:
+    trace_digest_t() : h(0), n(0) { }
+
+    void add(const proc_inst_t &inst) {
+        uint64_t regs = (uint64_t)inst.op_code | (uint64_t)(uint8_t)inst.dest_reg << 8
+                      | (uint64_t)(uint8_t)inst.src_reg[0] << 16 | (uint64_t)(uint8_t)inst.src_reg[1] << 24
+                      | (uint64_t)inst.flags << 32;
+        h = mix(h, regs);
+        h = mix(h, inst.instruction_address);
+        h = mix(h, inst.mem_addr);
+        n++;
+    }
+
+    uint64_t value() const { return mix(h, n); }
+    uint64_t count() const { return n; }
+
+private:
+    static uint64_t mix(uint64_t h, uint64_t v) {
+        h = (h ^ v) * 0x9e3779b97f4a7c15ull;
+        return h ^ (h >> 32);
+    }
+
+    uint64_t h;
+    uint64_t n;
+};
+
+/*
+  reads Trace_Rec entries straight from a trace file. gzip'd traces are
+  inflated in-process in large chunks; anything else is mmap'd and handed
+  out in place. "-" reads standard input (gzip'd or not).
+*/
+class trace_reader_t : public trace_source_t {
+public:
+    trace_reader_t();
+    ~trace_reader_t();
+
+    // returns false (and says why on stderr) if the trace cannot be read
+    bool open(const std::string &filename);
+    void close();
+
+    bool is_open() const { return gz != NULL || map != NULL; }
+    bool is_compressed() const { return gz != NULL; }
+
+    // every record handed out from now on, skipped or not, is added to
+    // digest. set it before another thread starts reading
+    void set_digest(trace_digest_t* d) { digest = d; }
+
+    // points records at the next batch of up to max entries and returns its
+    // length, 0 at the end of the trace. the batch stays valid until the next call.
+    size_t next_batch(const Trace_Rec** records, size_t max);
+
+    bool read_instruction(proc_inst_t* p_inst);
+    uint64_t skip(uint64_t n);
+
+private:
+    trace_reader_t(const trace_reader_t&);
+    trace_reader_t& operator=(const trace_reader_t&);
+
+    bool fill_chunk();
+
+    // gzip'd or streamed input
+    gzFile gz;
+    std::vector<Trace_Rec> chunk;
+
+    // mmap'd input
+    const Trace_Rec* map;
+    size_t map_bytes;
+
+    // records available in chunk (or map) and the next one to hand out
+    size_t avail;
+    size_t pos;
+
+    trace_digest_t* digest;
+};
+
+#endif /* TRACE_READER_H */